@@ -1,67 +1,203 @@
 // #include "vm_core.h"
 
 #include "vm_system.h"
+#include "vm_debug.h"
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 
-static bool read_hex_value(FILE* file, uint32_t* value) {
-    if (feof(file)) return false;
-    int c = 0;
-    int i = 0;
-    char buffer[16];
-    while (i < 14 && (c = getc(file)) != EOF) {
-        if (!isxdigit(c)) {
-            ungetc(c, file);
-            break;
-        }
-        buffer[i++] = (char)c;
-    }
-    buffer[i] = '\0';
-    if (strnlen(buffer, 16) == 0) {
-        return false;
-    }
-    return sscanf(buffer, "%X", value);
+static void print_usage(const char* program) {
+    printf("Usage: %s [options] rom_file\n", program);
+    puts("  --deterministic     run a fixed cycle budget every frame");
+    puts("  --record FILE       record controller input per frame (implies --deterministic)");
+    puts("  --replay FILE       replay recorded input headless at full speed");
+    puts("  --hashes FILE       write a memory/framebuffer hash every frame ('-' for stdout)");
+    puts("  --headless          run without a window (implies --deterministic)");
+    puts("  --frames N          stop after N frames");
+    puts("  --capture FILE      stream frames headless to FILE ('-' for stdout)");
+    puts("  --capture-format F  y4m (default) or rgb for raw RGB24 frames");
+    puts("  --trace FILE        write the address and cycles of every instruction ('-' for stdout)");
+    puts("  --banks FILE        map FILE as 8 KB banks switched into $8000-$BFFF");
+    puts("  --make-image FILE   write memory at power on as a memory image to FILE and exit");
+    puts("  --break ADDR        stop in the debug console before the instruction at ADDR");
+    puts("  --console           start in the debug console, Ctrl-C returns to it");
 }
 
-
 int main(int argc, char** argv) {
     atexit(cleanup_system);
 
-    if (argc < 2) {
+    const char* rom_filename = NULL;
+    const char* record_filename = NULL;
+    const char* replay_filename = NULL;
+    const char* hash_filename = NULL;
+    const char* trace_filename = NULL;
+    const char* bank_filename = NULL;
+    const char* capture_filename = NULL;
+    const char* image_filename = NULL;
+    capture_format_t capture_format = CAPTURE_Y4M;
+    const char* break_addresses[MAX_BREAKPOINTS];
+    int break_count = 0;
+    bool console = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (strcmp(arg, "--deterministic") == 0) {
+            vm_host.deterministic = true;
+        } else if (strcmp(arg, "--headless") == 0) {
+            vm_host.headless = true;
+        } else if (strcmp(arg, "--record") == 0 && has_value) {
+            record_filename = argv[++i];
+        } else if (strcmp(arg, "--replay") == 0 && has_value) {
+            replay_filename = argv[++i];
+        } else if (strcmp(arg, "--hashes") == 0 && has_value) {
+            hash_filename = argv[++i];
+        } else if (strcmp(arg, "--trace") == 0 && has_value) {
+            trace_filename = argv[++i];
+        } else if (strcmp(arg, "--capture") == 0 && has_value) {
+            capture_filename = argv[++i];
+        } else if (strcmp(arg, "--capture-format") == 0 && has_value) {
+            const char* format = argv[++i];
+            if (strcmp(format, "y4m") == 0) {
+                capture_format = CAPTURE_Y4M;
+            } else if (strcmp(format, "rgb") == 0) {
+                capture_format = CAPTURE_RGB;
+            } else {
+                printf("Unknown capture format %s\n", format);
+                return 1;
+            }
+        } else if (strcmp(arg, "--banks") == 0 && has_value) {
+            bank_filename = argv[++i];
+        } else if (strcmp(arg, "--make-image") == 0 && has_value) {
+            image_filename = argv[++i];
+            vm_host.headless = true;
+        } else if (strcmp(arg, "--break") == 0 && has_value && break_count < MAX_BREAKPOINTS) {
+            break_addresses[break_count++] = argv[++i];
+        } else if (strcmp(arg, "--console") == 0) {
+            console = true;
+        } else if (strcmp(arg, "--frames") == 0 && has_value) {
+            vm_host.max_frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (arg[0] == '-') {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            rom_filename = arg;
+        }
+    }
+
+    if (!rom_filename) {
         printf("Missing binary file\n");
         return 1;
     }
 
+    if (record_filename && replay_filename) {
+        printf("Can't record and replay at the same time\n");
+        return 1;
+    }
+
+    if (replay_filename) {
+        if (!replay_open_playback(&vm_host.replay, replay_filename)) {
+            return 1;
+        }
+        vm_host.headless = true;
+        vm_host.deterministic = true;
+        if (!hash_filename) {
+            hash_filename = "-";
+        }
+    }
+
+    if (record_filename) {
+        vm_host.deterministic = true;
+    }
+
+    if (capture_filename) {
+        vm_host.headless = true;
+        vm_host.deterministic = true;
+    }
+
+    // headless frames run back to back, so wall clock pacing would give them
+    // almost no cycles
+    if (vm_host.headless) {
+        vm_host.deterministic = true;
+    }
+
+    if (capture_filename && !start_capture(capture_filename, capture_format)) {
+        return 1;
+    }
+
+    if (hash_filename) {
+        vm_host.hash_file = strcmp(hash_filename, "-") == 0 ? stdout : fopen(hash_filename, "w");
+        if (!vm_host.hash_file) {
+            printf("Could not open %s\n", hash_filename);
+            return 1;
+        }
+    }
+
+    if (trace_filename) {
+        vm_host.trace_file = strcmp(trace_filename, "-") == 0 ? stdout : fopen(trace_filename, "w");
+        if (!vm_host.trace_file) {
+            printf("Could not open %s\n", trace_filename);
+            return 1;
+        }
+    }
+
+    if (console) {
+        // Ctrl-C breaks into the console instead of closing the window
+        SDL_SetHint(SDL_HINT_NO_SIGNAL_HANDLERS, "1");
+    }
+
+    // an image replaces RAM outright, sharing its pages with every other
+    // instance running it until they are written
+    bool mapped = !image_filename && is_memory_image(rom_filename);
+    if (mapped) {
+        vm_host.memory_image = map_memory_image(rom_filename);
+        if (!vm_host.memory_image) {
+            return 1;
+        }
+        attach_memory(vm_host.memory_image);
+    }
+
     init_system();
     vm.debug = false;
     vm.step = false;
 
-    const char* rom_filename = argv[1];
-    FILE* fp = fopen(rom_filename, "r");
-
-    while (!feof(fp)) {
-        uint32_t value;
-        if (read_hex_value(fp, &value)) {
-            uint16_t addr = (uint16_t)value;
-            int c = getc(fp);
-            while (c != '\n' && c != EOF) {
-                if (c != ' ' && c != ':') {
-                    ungetc(c, fp);
-                }
-                if (read_hex_value(fp, &value)) {
-                    vm.memory[addr++] = value;
-                }
-                c = getc(fp);
-            }
-        }
+    if (record_filename
+        && !replay_open_record(&vm_host.replay, record_filename, vm.clock_speed / FRAME_RATE)) {
+        return 1;
+    }
+
+    if (bank_filename && !load_bank_file(bank_filename)) {
+        return 1;
+    }
+
+    if (!mapped && !load_rom(rom_filename, vm.memory)) {
+        return 1;
     }
 
-    fclose(fp);
-    fp = NULL;
+    if (image_filename) {
+        return write_memory_image(image_filename, vm.memory) ? 0 : 1;
+    }
+
+    // breakpoints are patched into the loaded program
+    for (int i = 0; i < break_count; i++) {
+        char command[64];
+        snprintf(command, sizeof(command), "break %s", break_addresses[i]);
+        debug_command(command);
+    }
+
+    if (console) {
+        debug_enable_interrupt();
+        vm.running = true;
+        debug_console();
+        if (!vm.running) {
+            return 0;
+        }
+    }
 
     start_system_loop();
 
@@ -1,4 +1,7 @@
 #include "../../vm_system.h"
+#include "../../vm_debug.h"
+
+#include <string.h>
 
 #define MAX_RAM 0x1000
 #define TILESET_SIZE 0x0800
@@ -12,29 +15,66 @@
 #define SPRITE1 0xFCB2
 #define SPRITE1_X 0xFCB3
 #define SPRITE1_Y 0xFCB4
+#define BANK_SELECT0 0xFCB5     // bank shown at $8000-$9FFF
+#define BANK_SELECT1 0xFCB6     // bank shown at $A000-$BFFF
+#define PALETTE_START 0xFCC0    // 16 palette registers, one RRRGGGBB byte per color
+#define PALETTE_END 0xFCD0
+#define PALETTE_SIZE 16
+
+#define BANK_SIZE 0x2000
+#define BANK_SLOTS 2
+#define BANK_WINDOW_START 0x8000
+#define BANK_WINDOW_END 0xC000
+
+#define SCREEN_WIDTH 256    // 32 tiles
+#define SCREEN_HEIGHT 144   // 18 tiles
+#define BACKGROUND_ARGB 0xFF000000
+
+
+vm_host_t vm_host = {
+    .window = NULL,
+    .renderer = NULL,
+    .screen_width = 0,
+    .screen_height = 0,
+    .screen_zoom = 0,
+    .headless = false,
+    .deterministic = false,
+    .max_frames = 0,
+    .replay = { .file = NULL },
+    .hash_file = NULL,
+    .trace_file = NULL,
+    .capture = { .open = false },
+    .memory_image = NULL
+};
 
-
-
-palette_color_t palette[16] = {
-    {0, 0, 0},        // COLOR_BLACK
-    {255, 255, 255},  // COLOR_WHITE
-    {127, 127, 127},  // COLOR_GRAY
-    {29, 41, 119},    // COLOR_DARK_BLUE
-    {29, 97, 236},    // COLOR_LIGHT_BLUE
-    {14, 89, 12},     // COLOR_DARK_GREEN
-    {29, 171, 24},    // COLOR_LIGHT_GREEN
-    {0, 0, 0},
-    {0, 0, 0},
-    {0, 0, 0},
-    {0, 0, 0},
-    {0, 0, 0},
-    {0, 0, 0},
-    {0, 0, 0},
-    {0, 0, 0},
-    {255, 0, 255},     // COLOR_KEY
+// palette registers at power on
+static const uint8_t default_palette[PALETTE_SIZE] = {
+    0x00,   // COLOR_BLACK
+    0xFF,   // COLOR_WHITE
+    0x6D,   // COLOR_GRAY
+    0x25,   // COLOR_DARK_BLUE
+    0x2F,   // COLOR_LIGHT_BLUE
+    0x08,   // COLOR_DARK_GREEN
+    0x34,   // COLOR_LIGHT_GREEN
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    0xE3,   // COLOR_KEY, never drawn
 };
 
-bool rebuild_tileset = true;
+// banked ROM file, paged into the bank window by the bank select registers
+static vm_rom_file_t bank_rom = { .data = NULL, .size = 0 };
+static uint16_t bank_count = 0;
+
+// CPU-side copy of the screen as palette indices, and after the palette
+// lookup; composed only when something needs the pixels
+static uint8_t indexed_framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+static uint32_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT];
 
 enum {
     COLOR_BLACK,
@@ -54,7 +94,7 @@ enum {
 };
 
 uint8_t system_read_byte(uint16_t addr) {
-    return vm.memory[addr];
+    return READ_PAGED(addr);
 }
 
 uint16_t system_read_word(uint16_t addr) {
@@ -63,14 +103,51 @@ uint16_t system_read_word(uint16_t addr) {
     return COMBINE_TO_WORD(low, high);
 }
 
+static void select_bank(uint8_t slot, uint8_t bank) {
+    vm.memory[BANK_SELECT0 + slot] = bank;
+
+    if (bank_count) {
+        uint8_t* bank_data = bank_rom.data + (size_t)(bank % bank_count) * BANK_SIZE;
+        map_read_pages(BANK_WINDOW_START + slot * BANK_SIZE, BANK_SIZE, bank_data);
+    }
+}
+
+bool load_bank_file(const char* filename) {
+    if (!map_rom_file(filename, &bank_rom)) {
+        return false;
+    }
+
+    if (bank_rom.size % BANK_SIZE) {
+        printf("%s is not a whole number of %d byte banks, ignoring the tail\n", filename, BANK_SIZE);
+    }
+
+    size_t count = bank_rom.size / BANK_SIZE;
+    if (count == 0 || count > 0x100) {
+        printf("%s must hold between 1 and 256 banks\n", filename);
+        unmap_rom_file(&bank_rom);
+        return false;
+    }
+    bank_count = (uint16_t)count;
+
+    for (uint8_t slot = 0; slot < BANK_SLOTS; slot++) {
+        select_bank(slot, slot);
+    }
+    return true;
+}
+
 void system_write_byte(uint16_t addr, uint8_t value) {
     if (addr < MAX_RAM) {
         vm.memory[addr] = value;
     } else if (addr >= TILESET_START && addr < TILESET_END ) {
         vm.memory[addr] = value;
-        rebuild_tileset = true;
+    } else if (addr >= PALETTE_START && addr < PALETTE_END) {
+        vm.memory[addr] = value;
     } else if (addr >= SCREEN1_START && addr < SCREEN1_END) {
         vm.memory[addr] = value;
+    } else if (addr == BANK_SELECT0 || addr == BANK_SELECT1) {
+        select_bank(addr - BANK_SELECT0, value);
+    } else if (bank_count && addr >= BANK_WINDOW_START && addr < BANK_WINDOW_END) {
+        // banked ROM is read-only
     } else {
         printf("addr %04X = %02X\n", addr, value);
         vm.memory[addr] = value;
@@ -79,11 +156,19 @@ void system_write_byte(uint16_t addr, uint8_t value) {
 
 void init_system() {
     init_cpu();
+    // a memory image already holds the palette it was made with
+    if (!vm_host.memory_image) {
+        memcpy(vm.memory + PALETTE_START, default_palette, PALETTE_SIZE);
+    }
 
-    vm_host.screen_width = 256;   // 32 tiles
-    vm_host.screen_height = 144;  // 18 tiles
+    vm_host.screen_width = SCREEN_WIDTH;
+    vm_host.screen_height = SCREEN_HEIGHT;
     vm_host.screen_zoom = 4;
 
+    if (vm_host.headless) {
+        return;
+    }
+
     if( SDL_Init( SDL_INIT_VIDEO ) < 0 ) {
 		printf( "SDL could not initialize! SDL_Error: %s\n", SDL_GetError() );
         exit(1);
@@ -113,6 +198,23 @@ void init_system() {
 void cleanup_system() {
     puts("Cleaning up VM");
 
+    capture_close(&vm_host.capture);
+    replay_close(&vm_host.replay);
+    unmap_rom_file(&bank_rom);
+    bank_count = 0;
+    unmap_memory_image(vm_host.memory_image);
+    vm_host.memory_image = NULL;
+
+    if (vm_host.hash_file && vm_host.hash_file != stdout) {
+        fclose(vm_host.hash_file);
+    }
+    vm_host.hash_file = NULL;
+
+    if (vm_host.trace_file && vm_host.trace_file != stdout) {
+        fclose(vm_host.trace_file);
+    }
+    vm_host.trace_file = NULL;
+
     if (vm_host.renderer) {
         SDL_DestroyRenderer(vm_host.renderer);
         vm_host.renderer = NULL;
@@ -126,6 +228,10 @@ void cleanup_system() {
     SDL_Quit();
 }
 
+bool start_capture(const char* filename, capture_format_t format) {
+    return capture_open(&vm_host.capture, filename, format, SCREEN_WIDTH, SCREEN_HEIGHT, FRAME_RATE);
+}
+
 void handle_controller_event(SDL_Event* event) {
     int bit = -1;
     switch (event->key.keysym.sym) {
@@ -164,6 +270,126 @@ void handle_controller_event(SDL_Event* event) {
     }
 }
 
+static uint8_t tileset_pixel(uint8_t tile, uint8_t x, uint8_t y) {
+    // tileset is 64x64 pixels (8x8 tiles), two 4bpp pixels per byte
+    uint16_t px = (tile % 8) * 8 + x;
+    uint16_t py = (tile / 8) * 8 + y;
+    if (py >= 64) {
+        return COLOR_KEY;
+    }
+
+    uint8_t value = vm.memory[TILESET_START + py * 32 + px / 2];
+    return (px & 1) ? value & 0x0F : value >> 4;
+}
+
+// RRRGGGBB with the bits repeated to fill each channel, so 7 and 3 are 255
+static uint32_t palette_argb(uint8_t value) {
+    uint8_t r = (value >> 5) & 0x07;
+    uint8_t g = (value >> 2) & 0x07;
+    uint8_t b = value & 0x03;
+    return 0xFF000000
+        | (uint32_t)(r << 5 | r << 2 | r >> 1) << 16
+        | (uint32_t)(g << 5 | g << 2 | g >> 1) << 8
+        | (uint32_t)(b * 0x55);
+}
+
+// Tile map first, then the sprite on top, with COLOR_KEY pixels left
+// see-through. Pixels stay palette indices until the very end.
+static void compose_indexed_frame(uint8_t* indices) {
+    for (uint16_t i = 0; i < SCREEN_SIZE; i++) {
+        uint8_t tile = vm.memory[i + SCREEN1_START];
+        uint8_t* dst = indices + (i / 32) * 8 * SCREEN_WIDTH + (i % 32) * 8;
+
+        for (uint8_t y = 0; y < 8; y++) {
+            for (uint8_t x = 0; x < 8; x++) {
+                dst[y * SCREEN_WIDTH + x] = tileset_pixel(tile, x, y);
+            }
+        }
+    }
+
+    uint8_t tile = vm.memory[SPRITE1];
+    uint8_t sprite_x = vm.memory[SPRITE1_X];
+    uint8_t sprite_y = vm.memory[SPRITE1_Y];
+
+    for (uint8_t y = 0; y < 8; y++) {
+        uint16_t py = sprite_y + y;
+        for (uint8_t x = 0; x < 8; x++) {
+            uint16_t px = sprite_x + x;
+            uint8_t color = tileset_pixel(tile, x, y);
+            if (px < SCREEN_WIDTH && py < SCREEN_HEIGHT && color != COLOR_KEY) {
+                indices[py * SCREEN_WIDTH + px] = color;
+            }
+        }
+    }
+}
+
+// The palette registers are read once per frame, so a fade or flash is 16
+// register writes and nothing already drawn has to change.
+static void compose_frame(uint32_t* pixels) {
+    uint32_t colors[PALETTE_SIZE];
+    for (uint8_t i = 0; i < PALETTE_SIZE; i++) {
+        colors[i] = palette_argb(vm.memory[PALETTE_START + i]);
+    }
+    colors[COLOR_KEY] = BACKGROUND_ARGB;
+
+    compose_indexed_frame(indexed_framebuffer);
+    for (uint32_t i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+        pixels[i] = colors[indexed_framebuffer[i]];
+    }
+}
+
+static void write_frame_hash(uint32_t frame, const uint32_t* pixels) {
+    uint64_t hash = debug_hash_memory(FNV_OFFSET_BASIS);
+    hash = hash_bytes(hash, pixels, sizeof(framebuffer));
+    fprintf(vm_host.hash_file, "%u %016llx\n", frame, (unsigned long long)hash);
+}
+
+// Controller values are latched once per frame so a recording can put back
+// exactly what the guest saw.
+static void update_frame_input() {
+    uint8_t controllers[REPLAY_CONTROLLERS];
+
+    if (!vm_host.replay.file) {
+        return;
+    }
+
+    if (vm_host.replay.recording) {
+        controllers[0] = vm.memory[CONTROLLER1];
+        controllers[1] = vm.memory[CONTROLLER2];
+        replay_write_frame(&vm_host.replay, controllers);
+    } else if (replay_read_frame(&vm_host.replay, controllers)) {
+        vm.memory[CONTROLLER1] = controllers[0];
+        vm.memory[CONTROLLER2] = controllers[1];
+    } else {
+        // end of recording
+        vm.running = false;
+    }
+}
+
+static void run_cycles(double* cycles_left) {
+    while (vm.running && *cycles_left >= 1.0) {
+        uint16_t pc = vm.pc;
+        vm.cycle = 0;
+        cpu_cycle();
+
+        // checked against tools/cycle_analyzer.py; fused pairs show up as one line
+        if (vm_host.trace_file) {
+            fprintf(vm_host.trace_file, "%04X %u\n", pc, vm.cycle);
+        }
+
+        if (vm.debug) {
+            printf("Cycles: %d\n\n", (vm.cycle));
+        }
+        *cycles_left -= vm.cycle;
+    }
+}
+
+static void render_frame(SDL_Texture* screen_texture, const uint32_t* pixels) {
+    SDL_UpdateTexture(screen_texture, NULL, pixels, SCREEN_WIDTH * sizeof(uint32_t));
+    SDL_RenderCopy(vm_host.renderer, screen_texture, NULL, NULL);
+    SDL_RenderPresent(vm_host.renderer);
+}
+
 void start_system_loop() {
     vm.running = true;
     vm.cycle = 0;
@@ -172,28 +398,32 @@ void start_system_loop() {
         vm.debug = false;
     }
 
+    // recordings carry their own frame budget so they replay identically
+    uint32_t cycles_per_frame = vm_host.replay.file
+        ? vm_host.replay.cycles_per_frame
+        : vm.clock_speed / FRAME_RATE;
+    uint32_t frame = 0;
+
     uint32_t last_tick = SDL_GetTicks();
     float perf_counter_freq = (float)SDL_GetPerformanceFrequency();
     double cycles_left = 0;
 
-    const uint8_t tileset_width = 64;
-    const uint8_t tileset_height = 64;
-
-    SDL_Texture* tileset_texture = SDL_CreateTexture(
-        vm_host.renderer,
-        SDL_PIXELFORMAT_ARGB8888,
-        SDL_TEXTUREACCESS_STREAMING,
-        tileset_width,
-        tileset_height
-    );
-
-    SDL_SetTextureBlendMode(tileset_texture, SDL_BLENDMODE_BLEND);
+    SDL_Texture* screen_texture = NULL;
+    if (!vm_host.headless) {
+        screen_texture = SDL_CreateTexture(
+            vm_host.renderer,
+            SDL_PIXELFORMAT_ARGB8888,
+            SDL_TEXTUREACCESS_STREAMING,
+            SCREEN_WIDTH,
+            SCREEN_HEIGHT
+        );
+    }
 
     SDL_Event e;
     while (vm.running) {
         uint64_t start_frame = SDL_GetPerformanceCounter();
 
-        while (SDL_PollEvent(&e)) {
+        while (!vm_host.headless && SDL_PollEvent(&e)) {
             handle_controller_event(&e);
             switch (e.type) {
                 case SDL_QUIT:
@@ -218,66 +448,61 @@ void start_system_loop() {
         double delta = (current_tick - last_tick) / 1000.0;
         last_tick = current_tick;
 
-        if (!vm.step) {
+        if (vm_host.deterministic) {
+            update_frame_input();
+            if (!vm.running) {
+                break;
+            }
+            cycles_left += cycles_per_frame;
+            run_cycles(&cycles_left);
+        } else if (!vm.step) {
             if (cycles_left < 1) {
                 cycles_left += delta * vm.clock_speed;
             } else {
                 cycles_left = delta * vm.clock_speed;
             }
 
-            while (cycles_left >= 1.0) {
-                vm.cycle = 0;
-                cpu_cycle();
+            run_cycles(&cycles_left);
+        }
+
+        frame++;
 
-                if (vm.debug) {
-                    printf("Cycles: %d\n\n", (vm.cycle));
-                }
-                cycles_left -= vm.cycle;
+        // capture frames are composed in place and handed to the writer as is
+        uint32_t* pixels = NULL;
+        if (vm_host.capture.open) {
+            pixels = capture_acquire_frame(&vm_host.capture);
+            if (!pixels) {
+                break;
             }
+            compose_frame(pixels);
         }
 
-        if (rebuild_tileset) {
-            rebuild_tileset = false;
-            uint8_t* lockedPixels = NULL;
-            int pitch = 0;
-            
-            SDL_LockTexture(tileset_texture, NULL, (void**)&lockedPixels, &pitch);
-
-            for (int offset = 0; offset < TILESET_SIZE; offset++) {
-                uint8_t col2 = (vm.memory[TILESET_START + offset]) & 0x0F;
-                uint8_t col1 = (vm.memory[TILESET_START + offset]) >> 4;
-
-                lockedPixels[(offset * 8) + 0] = palette[col1].b;
-                lockedPixels[(offset * 8) + 1] = palette[col1].g;
-                lockedPixels[(offset * 8) + 2] = palette[col1].r;
-                lockedPixels[(offset * 8) + 3] = (col1 == COLOR_KEY ? SDL_ALPHA_TRANSPARENT : SDL_ALPHA_OPAQUE);
-                lockedPixels[(offset * 8) + 4] = palette[col2].b;
-                lockedPixels[(offset * 8) + 5] = palette[col2].g;
-                lockedPixels[(offset * 8) + 6] = palette[col2].r;
-                lockedPixels[(offset * 8) + 7] = (col2 == COLOR_KEY ? SDL_ALPHA_TRANSPARENT : SDL_ALPHA_OPAQUE);
+        if (vm_host.hash_file) {
+            if (!pixels) {
+                compose_frame(framebuffer);
+                pixels = framebuffer;
             }
-
-            SDL_UnlockTexture(tileset_texture);
+            write_frame_hash(frame, pixels);
         }
 
-        SDL_SetRenderDrawColor(vm_host.renderer, 0, 0, 0, 255);
-        SDL_RenderClear(vm_host.renderer);
+        if (vm_host.capture.open) {
+            capture_submit_frame(&vm_host.capture, pixels);
+        }
 
-        for (uint16_t i = 0; i < SCREEN_SIZE; i++) {
-            uint8_t tile = vm.memory[i + SCREEN1_START];
-            SDL_Rect srcrect = { .x=(tile % 8) * 8, .y=(tile / 8) * 8, .w=8, .h=8 };
-            SDL_Rect dstrect = { .x=(i % 32) * 8, .y=(i / 32) * 8, .w=8, .h=8 };
-            SDL_RenderCopy(vm_host.renderer, tileset_texture, &srcrect, &dstrect);
+        if (vm_host.max_frames && frame >= vm_host.max_frames) {
+            vm.running = false;
         }
 
-        uint8_t tile = vm.memory[SPRITE1];
-        uint8_t x = vm.memory[SPRITE1_X];
-        uint8_t y = vm.memory[SPRITE1_Y];
-        SDL_Rect srcrect = { .x=(tile % 8) * 8, .y=(tile / 8) * 8, .w=8, .h=8 };
-        SDL_Rect dstrect = { .x=x, .y=y, .w=8, .h=8 };
-        SDL_RenderCopy(vm_host.renderer, tileset_texture, &srcrect, &dstrect);
+        if (vm_host.headless) {
+            continue;
+        }
 
-        SDL_RenderPresent(vm_host.renderer);
+        // capture always runs headless, so pixels is never a frame handed to the writer here
+        if (!pixels) {
+            compose_frame(framebuffer);
+            pixels = framebuffer;
+        }
+        render_frame(screen_texture, pixels);
 
         uint64_t end_frame = SDL_GetPerformanceCounter();
         float elapsed_ms = (end_frame - start_frame) / perf_counter_freq * 1000.0f;
@@ -285,5 +510,7 @@ void start_system_loop() {
         SDL_Delay(delay);
     }
 
-    SDL_DestroyTexture(tileset_texture);
+    if (screen_texture) {
+        SDL_DestroyTexture(screen_texture);
+    }
 }
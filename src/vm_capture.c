@@ -0,0 +1,223 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "vm_capture.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void convert_y4m(const vm_capture_t* capture, const uint32_t* pixels, uint8_t* out) {
+    size_t plane_size = (size_t)capture->width * capture->height;
+    uint8_t* y_plane = out;
+    uint8_t* u_plane = out + plane_size;
+    uint8_t* v_plane = out + plane_size * 2;
+
+    // BT.601 studio range
+    for (size_t i = 0; i < plane_size; i++) {
+        int r = (pixels[i] >> 16) & 0xFF;
+        int g = (pixels[i] >> 8) & 0xFF;
+        int b = pixels[i] & 0xFF;
+        y_plane[i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        u_plane[i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        v_plane[i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+}
+
+static void convert_rgb(const vm_capture_t* capture, const uint32_t* pixels, uint8_t* out) {
+    size_t pixel_count = (size_t)capture->width * capture->height;
+    for (size_t i = 0; i < pixel_count; i++) {
+        out[i * 3 + 0] = (pixels[i] >> 16) & 0xFF;
+        out[i * 3 + 1] = (pixels[i] >> 8) & 0xFF;
+        out[i * 3 + 2] = pixels[i] & 0xFF;
+    }
+}
+
+static bool write_frame(vm_capture_t* capture, const uint32_t* pixels) {
+    size_t frame_size = (size_t)capture->width * capture->height * 3;
+
+    if (capture->format == CAPTURE_Y4M) {
+        convert_y4m(capture, pixels, capture->scanout);
+        if (fputs("FRAME\n", capture->file) == EOF) {
+            return false;
+        }
+    } else {
+        convert_rgb(capture, pixels, capture->scanout);
+    }
+
+    return fwrite(capture->scanout, frame_size, 1, capture->file) == 1;
+}
+
+static void* writer_thread(void* arg) {
+    vm_capture_t* capture = arg;
+
+    pthread_mutex_lock(&capture->lock);
+    while (true) {
+        while (capture->ready_count == 0 && !capture->closing) {
+            pthread_cond_wait(&capture->frame_ready, &capture->lock);
+        }
+        if (capture->ready_count == 0) {
+            break;
+        }
+
+        uint32_t* pixels = capture->ready_ring[capture->ready_head];
+        capture->ready_head = (capture->ready_head + 1) % CAPTURE_QUEUE_DEPTH;
+        capture->ready_count--;
+
+        // the emulator never touches a queued frame, so write it unlocked
+        pthread_mutex_unlock(&capture->lock);
+        bool ok = !capture->failed && write_frame(capture, pixels);
+        pthread_mutex_lock(&capture->lock);
+
+        if (!ok) {
+            // the reader going away (e.g. piped into head) ends the stream
+            capture->reader_closed = errno == EPIPE;
+            capture->failed = true;
+        } else {
+            capture->frames_written++;
+        }
+
+        int tail = (capture->free_head + capture->free_count) % CAPTURE_QUEUE_DEPTH;
+        capture->free_ring[tail] = pixels;
+        capture->free_count++;
+        pthread_cond_signal(&capture->frame_free);
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    if (fflush(capture->file) == EOF && !capture->failed) {
+        capture->reader_closed = errno == EPIPE;
+        capture->failed = true;
+    }
+    return NULL;
+}
+
+static void free_buffers(vm_capture_t* capture) {
+    for (int i = 0; i < CAPTURE_QUEUE_DEPTH; i++) {
+        free(capture->frames[i]);
+        capture->frames[i] = NULL;
+    }
+    free(capture->scanout);
+    capture->scanout = NULL;
+}
+
+bool capture_open(vm_capture_t* capture, const char* filename, capture_format_t format,
+                  int width, int height, int frame_rate) {
+    memset(capture, 0, sizeof(*capture));
+
+    if (strcmp(filename, "-") == 0) {
+        // keep the real stdout for video and send everything else printed to stderr
+        fflush(stdout);
+        int video_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        capture->file = video_fd < 0 ? NULL : fdopen(video_fd, "wb");
+    } else {
+        capture->file = fopen(filename, "wb");
+    }
+    if (!capture->file) {
+        printf("Could not open %s for capture\n", filename);
+        return false;
+    }
+
+    // a closed pipe shows up as EPIPE from the writer instead of killing the VM
+    signal(SIGPIPE, SIG_IGN);
+
+    capture->format = format;
+    capture->width = width;
+    capture->height = height;
+
+    size_t pixel_count = (size_t)width * height;
+    capture->scanout = malloc(pixel_count * 3);
+    bool allocated = capture->scanout != NULL;
+    for (int i = 0; i < CAPTURE_QUEUE_DEPTH; i++) {
+        capture->frames[i] = malloc(pixel_count * sizeof(uint32_t));
+        capture->free_ring[i] = capture->frames[i];
+        allocated = allocated && capture->frames[i];
+    }
+    capture->free_count = CAPTURE_QUEUE_DEPTH;
+    if (!allocated) {
+        printf("Could not allocate capture buffers\n");
+        free_buffers(capture);
+        fclose(capture->file);
+        capture->file = NULL;
+        return false;
+    }
+
+    if (format == CAPTURE_Y4M) {
+        fprintf(capture->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, frame_rate);
+    }
+
+    pthread_mutex_init(&capture->lock, NULL);
+    pthread_cond_init(&capture->frame_ready, NULL);
+    pthread_cond_init(&capture->frame_free, NULL);
+
+    if (pthread_create(&capture->writer, NULL, writer_thread, capture) != 0) {
+        printf("Could not start capture writer thread\n");
+        pthread_mutex_destroy(&capture->lock);
+        pthread_cond_destroy(&capture->frame_ready);
+        pthread_cond_destroy(&capture->frame_free);
+        free_buffers(capture);
+        fclose(capture->file);
+        capture->file = NULL;
+        return false;
+    }
+
+    capture->open = true;
+    return true;
+}
+
+// Returns a frame the caller may draw into, waiting for the writer if every
+// frame is queued. Returns NULL once the output has failed (e.g. closed pipe).
+uint32_t* capture_acquire_frame(vm_capture_t* capture) {
+    pthread_mutex_lock(&capture->lock);
+    while (capture->free_count == 0 && !capture->failed) {
+        pthread_cond_wait(&capture->frame_free, &capture->lock);
+    }
+
+    uint32_t* pixels = NULL;
+    if (!capture->failed) {
+        pixels = capture->free_ring[capture->free_head];
+        capture->free_head = (capture->free_head + 1) % CAPTURE_QUEUE_DEPTH;
+        capture->free_count--;
+    }
+    pthread_mutex_unlock(&capture->lock);
+
+    return pixels;
+}
+
+void capture_submit_frame(vm_capture_t* capture, uint32_t* pixels) {
+    pthread_mutex_lock(&capture->lock);
+    int tail = (capture->ready_head + capture->ready_count) % CAPTURE_QUEUE_DEPTH;
+    capture->ready_ring[tail] = pixels;
+    capture->ready_count++;
+    pthread_cond_signal(&capture->frame_ready);
+    pthread_mutex_unlock(&capture->lock);
+}
+
+// Drains queued frames, stops the writer and releases the buffers.
+void capture_close(vm_capture_t* capture) {
+    if (!capture->open) {
+        return;
+    }
+
+    pthread_mutex_lock(&capture->lock);
+    capture->closing = true;
+    pthread_cond_signal(&capture->frame_ready);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->writer, NULL);
+
+    if (capture->reader_closed) {
+        fprintf(stderr, "Capture reader closed the stream after %u frames\n", capture->frames_written);
+    } else if (capture->failed) {
+        fprintf(stderr, "Capture output failed after %u frames\n", capture->frames_written);
+    }
+
+    fclose(capture->file);
+    capture->file = NULL;
+    free_buffers(capture);
+
+    pthread_mutex_destroy(&capture->lock);
+    pthread_cond_destroy(&capture->frame_ready);
+    pthread_cond_destroy(&capture->frame_free);
+    capture->open = false;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Frames in flight between the emulator and the writer thread. When all of
+// them are queued the emulator waits, so it runs as fast as the consumer.
+#define CAPTURE_QUEUE_DEPTH 8
+
+typedef enum {
+    CAPTURE_Y4M,    // YUV4MPEG2, 4:4:4, readable by ffmpeg and most encoders
+    CAPTURE_RGB,    // raw packed RGB24 frames
+} capture_format_t;
+
+typedef struct {
+    FILE* file;
+    capture_format_t format;
+    int width;
+    int height;
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t frame_ready;
+    pthread_cond_t frame_free;
+
+    // ARGB8888 frames; ownership moves between the two rings without copying
+    uint32_t* frames[CAPTURE_QUEUE_DEPTH];
+    uint32_t* free_ring[CAPTURE_QUEUE_DEPTH];
+    uint32_t* ready_ring[CAPTURE_QUEUE_DEPTH];
+    int free_head, free_count;
+    int ready_head, ready_count;
+
+    uint8_t* scanout;       // one converted frame, owned by the writer
+    bool closing;
+    bool failed;
+    bool reader_closed;     // failed with EPIPE, the consumer has all it wanted
+    bool open;
+    uint32_t frames_written;
+} vm_capture_t;
+
+bool capture_open(vm_capture_t* capture, const char* filename, capture_format_t format,
+                  int width, int height, int frame_rate);
+uint32_t* capture_acquire_frame(vm_capture_t* capture);
+void capture_submit_frame(vm_capture_t* capture, uint32_t* pixels);
+void capture_close(vm_capture_t* capture);
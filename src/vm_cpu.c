@@ -1,22 +1,46 @@
 #include "vm_cpu.h"
-#include "vm_system.h"
+#include "vm_debug.h"
 
 #include <stdbool.h>
 #include <stdio.h>
 
-vm_host_t vm_host = {
-    .window = NULL,
-    .renderer = NULL,
-    .screen_width = 0,
-    .screen_height = 0,
-    .screen_zoom = 0
-};
+vm_t vm;
+
+// backing memory unless a memory image is attached, untouched pages of it
+// cost nothing
+static uint8_t ram[MAX_MEMORY];
+
+// ALU ops only record their result. Z/N/C are written into the status
+// register the first time anything reads or changes the flags afterwards,
+// so results that are overwritten before a branch never cost anything.
+uint8_t current_status() {
+    if (!vm.flags_lazy) {
+        return vm.status;
+    }
+
+    // status register (bits: 7-0 = xxxxxCNZ)
+    uint16_t result = vm.flags_result;
+    uint8_t flags = 0;
+    if ((result & 0xFF) == 0) flags |= FLAG_ZERO;
+    if (result & 0x80) flags |= FLAG_NEG;
+    if (result > 0xFF) flags |= FLAG_CARRY;
+    return (vm.status & ~(FLAG_ZERO | FLAG_NEG | FLAG_CARRY)) | flags;
+}
+
+static void materialize_flags() {
+    if (vm.flags_lazy) {
+        vm.status = current_status();
+        vm.flags_lazy = false;
+    }
+}
 
 uint8_t get_flag(uint8_t flag) {
+    materialize_flags();
     return (vm.status & flag) == flag;
 }
 
 void set_flag(uint8_t flag, bool high) {
+    materialize_flags();
     if (high) {
         vm.status |= flag;
     } else {
@@ -25,10 +49,8 @@ void set_flag(uint8_t flag, bool high) {
 }
 
 static void update_status_reg(uint16_t result) {
-    // status register (bits: 7-0 = xxxxxCNZ)
-    set_flag(FLAG_ZERO, (result & 0xFF) == 0);
-    set_flag(FLAG_NEG, (result & 0x80) == 0x80);
-    set_flag(FLAG_CARRY, result > 0xFF);
+    vm.flags_result = result;
+    vm.flags_lazy = true;
 }
 
 static bool is_high_reg(uint8_t reg) {
@@ -46,6 +68,9 @@ static bool is_word_reg(uint8_t reg) {
 }
 
 void init_cpu() {
+    // keeps memory attached before init, such as a memory image
+    attach_memory(vm.memory ? vm.memory : ram);
+
     vm.pc = 0x0200;
     vm.as = 0xFF;
     vm.ds = 0xFF;
@@ -53,16 +78,17 @@ void init_cpu() {
     vm.clock_speed = 1000000; // 1Mhz
 }
 
-static void print_debug() {
+void print_debug() {
+    uint8_t status = get_register(R_ST);
     printf("PC=$%04X X=$%04X Y=$%04X | AS=$%02X DS=$%02X | ", vm.pc, vm.x, vm.y, vm.as, vm.ds);
     for (int i = 0; i < R_COUNT; i++) {
         printf("r%d=$%02X ", i, get_register(i));
     }
     printf(
         "| Z=%d N=%d C=%d\n",
-        vm.status & 1,
-        (vm.status & 2) == 2,
-        (vm.status & 4) == 4
+        status & 1,
+        (status & 2) == 2,
+        (status & 4) == 4
     );
 }
 
@@ -183,17 +209,122 @@ static void handle_mov_op(uint8_t instruction) {
     }
 }
 
+// Superinstructions: the first instruction of a few very common pairs looks
+// ahead and, if the second one follows, runs both in a single dispatch. The
+// fused handlers charge exactly the cycles and set exactly the flags of the
+// two instructions they replace. Nothing is cached, so a branch straight to
+// the second instruction (or self-modified code) just runs it on its own.
+// Fusion is off while debugging or stepping, from the window or the debug
+// console, so every instruction is visible, and while watchpoints are armed
+// since a fused ret skips its stack reads.
+static bool fusion_enabled() {
+    return !vm.debug && !vm.step && !vm.stepping && !vm.watching;
+}
+
+static uint8_t peek_byte(uint16_t offset) {
+    return READ_PAGED((uint16_t)(vm.pc + offset));
+}
+
+// cmp reg, #imm ; beq/bne addr
+static bool fuse_cmp_branch() {
+    uint8_t branch = peek_byte(2);
+    if (branch != 0x01 && branch != 0x11) {
+        return false;
+    }
+
+    uint8_t reg = next_byte();
+    uint8_t value = next_byte();
+    cmp_register(reg, value);
+
+    vm.pc++;
+    vm.cycle++;
+    uint16_t addr = next_word();
+    if (get_flag(FLAG_ZERO) == (branch == 0x01)) vm.pc = addr;
+    return true;
+}
+
+// inc xl ; adc xh, #0
+static bool fuse_pointer_increment() {
+    if (peek_byte(0) != R_XL || peek_byte(1) != 0x63 || peek_byte(2) != R_XH || peek_byte(3) != 0x00) {
+        return false;
+    }
+
+    // only the adc's flags survive: they come from xh plus the carry out of xl
+    uint16_t high_result = HI_BYTE(vm.x) + (LO_BYTE(vm.x) == 0xFF);
+    vm.x++;
+    update_status_reg(high_result);
+
+    vm.pc += 4;
+    vm.cycle += 6;  // 4 operand fetches, 2 ALU ops
+    return true;
+}
+
+// dec reg ; bne addr
+static bool fuse_dec_branch() {
+    if (peek_byte(1) != 0x11) {
+        return false;
+    }
+
+    sub_register(next_byte(), 1, false);
+
+    vm.pc++;
+    vm.cycle++;
+    uint16_t addr = next_word();
+    if (!get_flag(FLAG_ZERO)) vm.pc = addr;
+    return true;
+}
+
+// jsr addr ; where addr holds a ret
+static bool fuse_call_return() {
+    uint16_t target = COMBINE_TO_WORD(peek_byte(0), peek_byte(1));
+    if (READ_PAGED(target) != 0x80) {
+        return false;
+    }
+
+    push_address(vm.pc + 2);
+    next_word();
+
+    // the ret fetches its opcode and pops what was just pushed
+    vm.as += 2;
+    vm.cycle += 3;
+    return true;
+}
+
 void cpu_cycle() {
-    uint8_t instruction = next_byte();
+    execute_instruction(next_byte());
+
+    // set by watchpoints and interrupts, which can't stop mid-instruction
+    if (vm.trap || debug_interrupted) {
+        debug_trap();
+    }
+
+    if (vm.debug) {
+        printf("\n");
+        print_debug();
+    }
+
+    // if (vm.debug) {
+    //     printf("\nData Stack:\n");
+    //     for (uint8_t i = 0xFF; i > vm.ds; i--) {
+    //         printf("$%02X: $%02X\n", i, read_byte(COMBINE_TO_WORD(i, 0x01)));
+    //     }
+    // }
+}
+
+void execute_instruction(uint8_t instruction) {
     uint8_t op = instruction & 0x0F;
 
     switch (op) {
         case 2: // mov 
             handle_mov_op(instruction);
             break;
+        case 5: // cmp
+            if (instruction == 0x25 && fusion_enabled() && fuse_cmp_branch()) {
+                break;
+            }
+            // fall through
         case 3: // add/adc
         case 4: // sub/sbb
-        case 5: // cmp
         case 7: // and/or
         case 8: // psh/pop
             // add, sub, cmp ops
@@ -213,9 +344,15 @@ void cpu_cycle() {
                     vm.pc = next_word();
                     break;
                 case 0x20: // inc
+                    if (fusion_enabled() && fuse_pointer_increment()) {
+                        break;
+                    }
                     add_register(next_byte(), 1, false);
                     break;
                 case 0x30: // dec
+                    if (fusion_enabled() && fuse_dec_branch()) {
+                        break;
+                    }
                     sub_register(next_byte(), 1, false);
                     break;
                 case 0x40: // clc
@@ -226,6 +363,9 @@ void cpu_cycle() {
                     not_register(next_byte());
                     break;
                 case 0x70: // jsr
+                    if (fusion_enabled() && fuse_call_return()) {
+                        break;
+                    }
                     push_address(vm.pc + 2);
                     vm.pc = next_word();
                     break;
@@ -268,38 +408,48 @@ void cpu_cycle() {
                         if (get_flag(FLAG_ZERO) || !get_flag(FLAG_CARRY)) vm.pc = addr;
                     }
                     break;
+                case 0xfd: // breakpoint patched over an opcode
+                    debug_breakpoint();
+                    break;
                 default:
                     handle_bad_instruction(instruction);
                     break;
             }
     }
+}
 
-    if (vm.debug) {
-        printf("\n");
-        print_debug();
+// Every CPU data access goes through these two. Pages with breakpoints or
+// watchpoints are flagged so only their accesses take the debugger's path.
+static uint8_t bus_read(uint16_t addr) {
+    if (vm.page_flags[HI_BYTE(addr)]) {
+        return debug_read_byte(addr);
     }
+    return system_read_byte(addr);
+}
 
-    // if (vm.debug) {
-    //     printf("\nData Stack:\n");
-    //     for (uint8_t i = 0xFF; i > vm.ds; i--) {
-    //         printf("$%02X: $%02X\n", i, read_byte(COMBINE_TO_WORD(i, 0x01)));
-    //     }
-    // }
+static void bus_write(uint16_t addr, uint8_t value) {
+    if (vm.page_flags[HI_BYTE(addr)]) {
+        return debug_write_byte(addr, value);
+    }
+    system_write_byte(addr, value);
 }
 
+// tools/cycle_table.py mirrors every vm.cycle charge, keep the two in step
 uint8_t read_byte(uint16_t addr) {
     vm.cycle++;
-    return system_read_byte(addr);
+    return bus_read(addr);
 }
 
 uint16_t read_word(uint16_t addr) {
     vm.cycle += 2;
-    return system_read_word(addr);
+    uint8_t low = bus_read(addr);
+    uint8_t high = bus_read(addr + 1);
+    return COMBINE_TO_WORD(low, high);
 }
 
 void write_byte(uint16_t addr, uint8_t value) {
     vm.cycle++;
-    system_write_byte(addr, value);
+    bus_write(addr, value);
 }
 
 void write_bytes(uint16_t start_addr, uint16_t nbytes, uint8_t* bytes) {
@@ -308,12 +458,27 @@ void write_bytes(uint16_t start_addr, uint16_t nbytes, uint8_t* bytes) {
     }
 }
 
+void map_read_pages(uint16_t start_addr, uint32_t nbytes, uint8_t* source) {
+    for (uint32_t offset = 0; offset < nbytes; offset += VM_PAGE_SIZE) {
+        vm.read_pages[HI_BYTE(start_addr + offset) & 0xFF] = source + offset;
+    }
+}
+
+// Makes memory the whole address space, replacing any pages mapped elsewhere,
+// so attach before mapping banks.
+void attach_memory(uint8_t* memory) {
+    vm.memory = memory;
+    map_read_pages(0x0000, MAX_MEMORY, vm.memory);
+}
+
 uint8_t next_byte() {
     if (vm.debug) {
-        printf("$%02X ", vm.memory[vm.pc]);
+        printf("$%02X ", READ_PAGED(vm.pc));
     }
     vm.cycle++;
-    return vm.memory[vm.pc++];
+    uint8_t value = READ_PAGED(vm.pc);
+    vm.pc++;
+    return value;
 }
 
 uint16_t next_word() {
@@ -332,6 +497,7 @@ void set_register(uint8_t reg, uint8_t value) {
     switch (reg) {
         case R_ST:
             vm.status = value;
+            vm.flags_lazy = false;
             break;
         case R_AS:
             vm.as = value;
@@ -352,10 +518,10 @@ void set_register(uint8_t reg, uint8_t value) {
             vm.y = (vm.y & 0x00FF) + (value << 8);
             break;
         case R_X:
-            system_write_byte(vm.x, value);
+            bus_write(vm.x, value);
             break;
         case R_Y:
-            system_write_byte(vm.y, value);
+            bus_write(vm.y, value);
             break;
         default:
             return;
@@ -369,6 +535,7 @@ uint8_t get_register(uint8_t reg) {
 
     switch (reg) {
         case R_ST:
+            materialize_flags();
             return vm.status;
         case R_AS:
             return vm.as;
@@ -4,12 +4,15 @@
 #include <stdbool.h>
 
 #define MAX_MEMORY 0x10000
+#define VM_PAGE_SIZE 0x100
+#define VM_PAGE_COUNT (MAX_MEMORY / VM_PAGE_SIZE)
 
 #define LO_BYTE(word) ((word) & 0xFF)
 #define HI_BYTE(word) ((word) >> 8)
 #define COMBINE_TO_WORD(lowb, highb) (((uint16_t)(highb) << 8) + (lowb))
 #define SET_BIT(bitfield, bit) (bitfield |= 1 << bit)
 #define CLEAR_BIT(bitfield, bit) (bitfield &= ~(1 << bit))
+#define READ_PAGED(addr) (vm.read_pages[HI_BYTE(addr)][LO_BYTE(addr)])
 
 // general purpose regisers r0-r7
 enum {
@@ -40,10 +43,14 @@ enum {
 };
 
 typedef struct {
-    uint8_t memory[MAX_MEMORY];
+    uint8_t* memory;        // MAX_MEMORY bytes, the CPU's own RAM or a mapped memory image
+    uint8_t* read_pages[VM_PAGE_COUNT];  // backing storage for reads of each 256 byte page
+    uint8_t page_flags[VM_PAGE_COUNT];   // debugger hooks per page, non-zero sends accesses to vm_debug
     
     uint8_t registers[R_COUNT];
-    uint8_t status;         // status flags register
+    uint8_t status;         // status flags register, Z/N/C are stale while flags_lazy is set
+    uint16_t flags_result;  // last ALU result, Z/N/C are derived from it on demand
+    bool flags_lazy;
     uint8_t as;             // address stack pointer
     uint8_t ds;             // data stack pointer
     
@@ -54,21 +61,30 @@ typedef struct {
     bool running;
     bool debug;
     bool step;
+    bool trap;              // a watchpoint hit, stop in the debug console after the current instruction
+    bool watching;          // watchpoints are armed, fused instructions would hide accesses
+    bool stepping;          // the debug console is running one instruction at a time
 
     uint32_t cycle;
     uint32_t clock_speed;
 } vm_t;
 
-vm_t vm;
+extern vm_t vm;
 
 void init_cpu();
 void cpu_cycle();
+void execute_instruction(uint8_t instruction);
+void print_debug();
+uint8_t current_status();   // status register with pending flags applied, changes nothing
 
 uint8_t read_byte(uint16_t addr);
 uint16_t read_word(uint16_t addr);
 void write_byte(uint16_t addr, uint8_t value);
 void write_bytes(uint16_t start_addr, uint16_t nbytes, uint8_t* bytes);
 
+void map_read_pages(uint16_t start_addr, uint32_t nbytes, uint8_t* source);
+void attach_memory(uint8_t* memory);
+
 uint8_t next_byte();
 uint16_t next_word();
 
@@ -90,3 +106,8 @@ uint8_t pop_byte();
 
 void push_address(uint16_t addr);
 uint16_t pop_address();
+
+// the machine's memory map, implemented in src/systems/<machine>/vm_system.c
+uint8_t system_read_byte(uint16_t addr);
+uint16_t system_read_word(uint16_t addr);
+void system_write_byte(uint16_t addr, uint8_t value);
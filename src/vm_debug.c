@@ -0,0 +1,723 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "vm_debug.h"
+#include "vm_cpu.h"
+#include "vm_replay.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// Breakpoints replace the opcode at their address with OP_BREAKPOINT, so
+// execution costs nothing until one is reached. Watchpoints flag the pages
+// they cover in vm.page_flags; only accesses to flagged pages come here.
+// Watchpoint hits happen mid-instruction, so they set vm.trap and the
+// console opens once the instruction has finished.
+
+static breakpoint_t breakpoints[MAX_BREAKPOINTS];
+static watchpoint_t watchpoints[MAX_WATCHPOINTS];
+
+static bool console_open = true;    // cleared when stdin runs out
+static uint32_t steps_taken = 0;
+static char stop_reason[128];
+
+static const char* op_names[] = { "==", "!=", "<", "<=", ">", ">=" };
+
+static const char* register_names[] = {
+    "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+    "st", "as", "ds", "xl", "xh", "yl", "yh"
+};
+
+volatile sig_atomic_t debug_interrupted = 0;
+
+static void handle_interrupt(int signal) {
+    (void)signal;
+    debug_interrupted = 1;
+}
+
+void debug_enable_interrupt() {
+    signal(SIGINT, handle_interrupt);
+}
+
+static breakpoint_t* find_breakpoint(uint16_t addr) {
+    for (int i = 0; i < MAX_BREAKPOINTS; i++) {
+        if (breakpoints[i].active && breakpoints[i].addr == addr) {
+            return &breakpoints[i];
+        }
+    }
+    return NULL;
+}
+
+// memory as the program sees it, without patched opcodes and without cycles
+static uint8_t peek_memory(uint16_t addr) {
+    breakpoint_t* breakpoint = find_breakpoint(addr);
+    return breakpoint ? breakpoint->original : system_read_byte(addr);
+}
+
+// Hashes memory as the program sees it, so --break leaves --hash output alone:
+// the original opcodes go back for the length of the hash.
+uint64_t debug_hash_memory(uint64_t hash) {
+    for (int i = 0; i < MAX_BREAKPOINTS; i++) {
+        if (breakpoints[i].active) {
+            vm.memory[breakpoints[i].addr] = breakpoints[i].original;
+        }
+    }
+    hash = hash_bytes(hash, vm.memory, MAX_MEMORY);
+    for (int i = 0; i < MAX_BREAKPOINTS; i++) {
+        if (breakpoints[i].active) {
+            vm.memory[breakpoints[i].addr] = OP_BREAKPOINT;
+        }
+    }
+    return hash;
+}
+
+static void update_page_flags() {
+    memset(vm.page_flags, 0, sizeof(vm.page_flags));
+    vm.watching = false;
+
+    for (int i = 0; i < MAX_BREAKPOINTS; i++) {
+        if (breakpoints[i].active) {
+            vm.page_flags[HI_BYTE(breakpoints[i].addr)] |= PAGE_BREAKPOINT;
+        }
+    }
+
+    for (int i = 0; i < MAX_WATCHPOINTS; i++) {
+        watchpoint_t* watch = &watchpoints[i];
+        if (!watch->active) {
+            continue;
+        }
+        vm.watching = true;
+        for (uint32_t page = HI_BYTE(watch->start); page <= HI_BYTE(watch->end - 1); page++) {
+            vm.page_flags[page] |= watch->access;
+        }
+    }
+}
+
+static bool check_condition(const debug_condition_t* condition, uint8_t value) {
+    uint16_t lhs = 0;
+    switch (condition->source) {
+        case COND_ALWAYS:
+            return true;
+        case COND_REGISTER:
+            lhs = get_register(condition->operand);
+            break;
+        case COND_MEMORY:
+            lhs = peek_memory(condition->operand);
+            break;
+        case COND_VALUE:
+            lhs = value;
+            break;
+        case COND_PC:
+            lhs = vm.pc;
+            break;
+        case COND_X:
+            lhs = vm.x;
+            break;
+        case COND_Y:
+            lhs = vm.y;
+            break;
+    }
+
+    switch (condition->op) {
+        case COND_EQ: return lhs == condition->value;
+        case COND_NE: return lhs != condition->value;
+        case COND_LT: return lhs < condition->value;
+        case COND_LE: return lhs <= condition->value;
+        case COND_GT: return lhs > condition->value;
+        case COND_GE: return lhs >= condition->value;
+    }
+    return false;
+}
+
+static void print_condition(const debug_condition_t* condition) {
+    switch (condition->source) {
+        case COND_ALWAYS:
+            return;
+        case COND_REGISTER:
+            printf(" if %s", register_names[condition->operand]);
+            break;
+        case COND_MEMORY:
+            printf(" if [$%04X]", condition->operand);
+            break;
+        case COND_VALUE:
+            printf(" if value");
+            break;
+        case COND_PC:
+            printf(" if pc");
+            break;
+        case COND_X:
+            printf(" if x");
+            break;
+        case COND_Y:
+            printf(" if y");
+            break;
+    }
+    printf(" %s $%X", op_names[condition->op], condition->value);
+}
+
+void debug_breakpoint() {
+    uint16_t addr = vm.pc - 1;
+    breakpoint_t* breakpoint = find_breakpoint(addr);
+    if (!breakpoint) {
+        printf("$%04X: Unknown opcode $%02X\n", addr, OP_BREAKPOINT);
+        vm.running = false;
+        return;
+    }
+
+    if (!vm.stepping && check_condition(&breakpoint->condition, 0) && ++breakpoint->hits > breakpoint->ignore) {
+        snprintf(stop_reason, sizeof(stop_reason), "breakpoint %d at $%04X (hit %u)",
+            (int)(breakpoint - breakpoints), addr, breakpoint->hits);
+        uint32_t steps_before = steps_taken;
+        vm.pc = addr;
+        debug_console();
+
+        // stepping from the console already ran this instruction
+        if (steps_taken != steps_before || vm.pc != addr || !vm.running) {
+            return;
+        }
+        vm.pc++;
+    }
+
+    // the opcode fetch was already charged for the patched byte
+    execute_instruction(breakpoint->original);
+}
+
+void debug_trap() {
+    vm.trap = false;
+    debug_interrupted = 0;
+    if (vm.stepping) {
+        return;
+    }
+    if (!stop_reason[0]) {
+        snprintf(stop_reason, sizeof(stop_reason), "interrupted");
+    }
+    debug_console();
+}
+
+static void check_watchpoints(uint16_t addr, uint8_t value, uint8_t access) {
+    if (vm.stepping) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_WATCHPOINTS; i++) {
+        watchpoint_t* watch = &watchpoints[i];
+        if (!watch->active || !(watch->access & access) || addr < watch->start || addr >= watch->end) {
+            continue;
+        }
+        if (check_condition(&watch->condition, value) && ++watch->hits > watch->ignore) {
+            snprintf(stop_reason, sizeof(stop_reason), "watchpoint %d: %s $%04X = $%02X (hit %u)",
+                i, access == PAGE_WATCH_READ ? "read" : "write", addr, value, watch->hits);
+            vm.trap = true;
+        }
+    }
+}
+
+uint8_t debug_read_byte(uint16_t addr) {
+    uint8_t value = peek_memory(addr);
+    if (vm.page_flags[HI_BYTE(addr)] & PAGE_WATCH_READ) {
+        check_watchpoints(addr, value, PAGE_WATCH_READ);
+    }
+    return value;
+}
+
+void debug_write_byte(uint16_t addr, uint8_t value) {
+    if (vm.page_flags[HI_BYTE(addr)] & PAGE_WATCH_WRITE) {
+        check_watchpoints(addr, value, PAGE_WATCH_WRITE);
+    }
+
+    breakpoint_t* breakpoint = find_breakpoint(addr);
+    system_write_byte(addr, value);
+    if (breakpoint && (vm.memory[addr] != OP_BREAKPOINT || value == OP_BREAKPOINT)) {
+        // code was rewritten under the breakpoint, keep it armed over the new opcode
+        breakpoint->original = vm.memory[addr];
+        vm.memory[addr] = OP_BREAKPOINT;
+    }
+}
+
+// $hex, 0xhex or decimal; value is left alone unless the whole token parses
+static bool parse_number(const char* text, uint32_t* value) {
+    char* end = NULL;
+    uint32_t result = 0;
+    if (!text || !text[0]) {
+        return false;
+    }
+    if (text[0] == '$') {
+        text++;
+        result = (uint32_t)strtoul(text, &end, 16);
+    } else {
+        result = (uint32_t)strtoul(text, &end, 0);
+    }
+    if (end == text || *end != '\0') {
+        return false;
+    }
+    *value = result;
+    return true;
+}
+
+static bool parse_address(const char* text, uint16_t* addr) {
+    uint32_t value = 0;
+    if (!parse_number(text, &value) || value >= MAX_MEMORY) {
+        printf("Bad address %s\n", text ? text : "");
+        return false;
+    }
+    *addr = (uint16_t)value;
+    return true;
+}
+
+static bool parse_register(const char* text, uint8_t* reg) {
+    for (uint8_t i = 0; i < sizeof(register_names) / sizeof(register_names[0]); i++) {
+        if (strcasecmp(text, register_names[i]) == 0) {
+            *reg = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// [after N] [if LHS OP VALUE] where LHS is a register, pc, x, y, [ADDR] or value
+static bool parse_options(char** saveptr, uint32_t* ignore, debug_condition_t* condition, bool allow_value) {
+    char* token = NULL;
+    *ignore = 0;
+    condition->source = COND_ALWAYS;
+
+    while ((token = strtok_r(NULL, " \t\n", saveptr))) {
+        if (strcmp(token, "after") == 0) {
+            if (!parse_number(strtok_r(NULL, " \t\n", saveptr), ignore)) {
+                puts("after needs a hit count");
+                return false;
+            }
+        } else if (strcmp(token, "if") == 0) {
+            char* lhs = strtok_r(NULL, " \t\n", saveptr);
+            char* op = strtok_r(NULL, " \t\n", saveptr);
+            char* rhs = strtok_r(NULL, " \t\n", saveptr);
+            uint32_t value = 0;
+            uint8_t reg = 0;
+
+            if (!lhs || !op || !parse_number(rhs, &value)) {
+                puts("Conditions look like: if r0 == $10");
+                return false;
+            }
+            condition->value = (uint16_t)value;
+
+            if (strcasecmp(lhs, "pc") == 0) {
+                condition->source = COND_PC;
+            } else if (strcasecmp(lhs, "x") == 0) {
+                condition->source = COND_X;
+            } else if (strcasecmp(lhs, "y") == 0) {
+                condition->source = COND_Y;
+            } else if (allow_value && strcasecmp(lhs, "value") == 0) {
+                condition->source = COND_VALUE;
+            } else if (parse_register(lhs, &reg)) {
+                condition->source = COND_REGISTER;
+                condition->operand = reg;
+            } else if (lhs[0] == '[' && lhs[strlen(lhs) - 1] == ']') {
+                lhs[strlen(lhs) - 1] = '\0';
+                if (!parse_address(lhs + 1, &condition->operand)) {
+                    return false;
+                }
+                condition->source = COND_MEMORY;
+            } else {
+                printf("Can't test %s\n", lhs);
+                return false;
+            }
+
+            bool found = false;
+            for (int i = 0; i < 6; i++) {
+                if (strcmp(op, op_names[i]) == 0) {
+                    condition->op = (debug_condition_op_t)i;
+                    found = true;
+                }
+            }
+            if (!found) {
+                printf("Unknown comparison %s\n", op);
+                return false;
+            }
+        } else {
+            printf("Unexpected %s\n", token);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Bytes taken by the instruction starting with opcode, 0 for opcodes the CPU
+// rejects. Same table as tools/cycle_table.py.
+static uint8_t instruction_length(uint8_t opcode) {
+    static const uint8_t source_lengths[] = { 1, 2, 1, 2 };    // register, mem, immediate, indirect
+    uint8_t op = opcode & 0x0F;
+    uint8_t mode = opcode >> 4;
+
+    if (op == 2) {
+        return mode < 0xC ? 1 + (mode < 4 ? 1 : 2) + source_lengths[mode % 4] : 0;
+    }
+    if (op == 3 || op == 4 || op == 5 || op == 7) {
+        return mode < 8 ? 2 + source_lengths[mode % 4] : 0;
+    }
+    if (op == 8) {
+        if (mode < 4) {
+            return 1 + source_lengths[mode];
+        }
+        return mode == 4 ? 2 : (mode == 5 || mode == 7) ? 3 : 0;
+    }
+
+    switch (opcode) {
+        case 0x00: case 0x40: case 0x50: case 0x80: case 0xFE: case 0xFF:
+            return 1;
+        case 0x20: case 0x30: case 0x60:
+            return 2;
+        case 0x10: case 0x70:
+        case 0x01: case 0x11: case 0x21: case 0x31: case 0x41: case 0x51:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+// What a decode of the program from the reset address and the current pc
+// says about addr, following jumps, branches and calls. Code only reached
+// through self-modification or a rewritten return address stays unknown.
+typedef enum {
+    CODE_UNKNOWN,
+    CODE_START,
+    CODE_OPERAND,
+} code_role_t;
+
+static code_role_t code_role(uint16_t addr, uint16_t* owner) {
+    static uint8_t roles[MAX_MEMORY];
+    static uint16_t pending[MAX_MEMORY];
+    uint32_t pending_count = 0;
+
+    memset(roles, CODE_UNKNOWN, sizeof(roles));
+    pending[pending_count++] = 0x0200;  // reset address, see init_cpu
+    pending[pending_count++] = vm.pc;
+
+    while (pending_count) {
+        uint16_t pc = pending[--pending_count];
+        while (roles[pc] != CODE_START) {
+            uint8_t opcode = peek_memory(pc);
+            uint8_t length = instruction_length(opcode);
+            if (length == 0) {
+                break;
+            }
+            roles[pc] = CODE_START;
+            for (uint8_t i = 1; i < length; i++) {
+                uint16_t operand = (uint16_t)(pc + i);
+                if (roles[operand] != CODE_START) {
+                    roles[operand] = CODE_OPERAND;
+                }
+                if (operand == addr) {
+                    *owner = pc;
+                }
+            }
+
+            uint16_t next = (uint16_t)(pc + length);
+            if (opcode == 0x10 || opcode == 0x70 || (opcode & 0x0F) == 0x01) {
+                uint16_t target = COMBINE_TO_WORD(peek_memory(pc + 1), peek_memory(pc + 2));
+                if (roles[target] != CODE_START && pending_count < MAX_MEMORY) {
+                    pending[pending_count++] = target;
+                }
+            }
+            if (opcode == 0x10 || opcode == 0x80 || opcode == 0xFF) {
+                break;
+            }
+            pc = next;
+        }
+    }
+    return roles[addr];
+}
+
+// Breakpoints overwrite a byte, so they must land on an opcode: one in an
+// operand would change what the instruction does instead of stopping.
+static bool check_instruction_start(uint16_t addr) {
+    uint16_t owner = 0;
+    code_role_t role = code_role(addr, &owner);
+    if (role == CODE_OPERAND) {
+        printf("$%04X is inside the instruction at $%04X\n", addr, owner);
+        return false;
+    }
+    if (role == CODE_UNKNOWN) {
+        if (instruction_length(peek_memory(addr)) == 0) {
+            printf("$%04X holds $%02X, which is not an opcode\n", addr, peek_memory(addr));
+            return false;
+        }
+        printf("$%04X is not reached from $0200 or pc, assuming an instruction starts there\n", addr);
+    }
+    return true;
+}
+
+static void add_breakpoint(char** saveptr) {
+    uint16_t addr = 0;
+    if (!parse_address(strtok_r(NULL, " \t\n", saveptr), &addr)) {
+        return;
+    }
+    if (find_breakpoint(addr)) {
+        printf("There is already a breakpoint at $%04X\n", addr);
+        return;
+    }
+    if (vm.read_pages[HI_BYTE(addr)] != vm.memory + (addr & 0xFF00)) {
+        printf("$%04X is banked ROM, breakpoints need code in memory\n", addr);
+        return;
+    }
+    if (!check_instruction_start(addr)) {
+        return;
+    }
+
+    for (int i = 0; i < MAX_BREAKPOINTS; i++) {
+        breakpoint_t* breakpoint = &breakpoints[i];
+        if (breakpoint->active) {
+            continue;
+        }
+        if (!parse_options(saveptr, &breakpoint->ignore, &breakpoint->condition, false)) {
+            return;
+        }
+        breakpoint->active = true;
+        breakpoint->addr = addr;
+        breakpoint->hits = 0;
+        breakpoint->original = vm.memory[addr];
+        vm.memory[addr] = OP_BREAKPOINT;
+        update_page_flags();
+        printf("Breakpoint %d at $%04X\n", i, addr);
+        return;
+    }
+    puts("Too many breakpoints");
+}
+
+static void add_watchpoint(char** saveptr) {
+    char* kind = strtok_r(NULL, " \t\n", saveptr);
+    uint8_t access = 0;
+    uint16_t start = 0;
+    uint32_t length = 1;
+
+    if (kind && strcmp(kind, "r") == 0) {
+        access = PAGE_WATCH_READ;
+    } else if (kind && strcmp(kind, "w") == 0) {
+        access = PAGE_WATCH_WRITE;
+    } else if (kind && strcmp(kind, "rw") == 0) {
+        access = PAGE_WATCH_READ | PAGE_WATCH_WRITE;
+    } else {
+        puts("watch r|w|rw ADDR [LENGTH] ...");
+        return;
+    }
+
+    if (!parse_address(strtok_r(NULL, " \t\n", saveptr), &start)) {
+        return;
+    }
+
+    // an optional length comes before any options, peek at the next word
+    char* next = *saveptr + strspn(*saveptr, " \t\n");
+    size_t next_length = strcspn(next, " \t\n");
+    char word[16];
+    if (next_length > 0 && next_length < sizeof(word)) {
+        memcpy(word, next, next_length);
+        word[next_length] = '\0';
+        if (parse_number(word, &length)) {
+            *saveptr = next + next_length;
+        }
+    }
+    if (length == 0 || start + length > MAX_MEMORY) {
+        puts("Bad watch length");
+        return;
+    }
+
+    for (int i = 0; i < MAX_WATCHPOINTS; i++) {
+        watchpoint_t* watch = &watchpoints[i];
+        if (watch->active) {
+            continue;
+        }
+        if (!parse_options(saveptr, &watch->ignore, &watch->condition, true)) {
+            return;
+        }
+        watch->active = true;
+        watch->start = start;
+        watch->end = start + length;
+        watch->access = access;
+        watch->hits = 0;
+        update_page_flags();
+        printf("Watchpoint %d on $%04X-$%04X\n", i, start, (unsigned)watch->end - 1);
+        return;
+    }
+    puts("Too many watchpoints");
+}
+
+static void delete_point(char** saveptr, bool watch) {
+    uint32_t index = 0;
+    if (!parse_number(strtok_r(NULL, " \t\n", saveptr), &index)
+        || index >= (watch ? MAX_WATCHPOINTS : MAX_BREAKPOINTS)) {
+        puts("Which one?");
+        return;
+    }
+
+    if (watch) {
+        watchpoints[index].active = false;
+    } else if (breakpoints[index].active) {
+        vm.memory[breakpoints[index].addr] = breakpoints[index].original;
+        breakpoints[index].active = false;
+    }
+    update_page_flags();
+}
+
+static void list_points() {
+    for (int i = 0; i < MAX_BREAKPOINTS; i++) {
+        breakpoint_t* breakpoint = &breakpoints[i];
+        if (breakpoint->active) {
+            printf("break %d: $%04X hits %u", i, breakpoint->addr, breakpoint->hits);
+            if (breakpoint->ignore) printf(" after %u", breakpoint->ignore);
+            print_condition(&breakpoint->condition);
+            printf("\n");
+        }
+    }
+    for (int i = 0; i < MAX_WATCHPOINTS; i++) {
+        watchpoint_t* watch = &watchpoints[i];
+        if (watch->active) {
+            printf("watch %d: %s%s $%04X-$%04X hits %u", i,
+                (watch->access & PAGE_WATCH_READ) ? "r" : "",
+                (watch->access & PAGE_WATCH_WRITE) ? "w" : "",
+                watch->start, (unsigned)watch->end - 1, watch->hits);
+            if (watch->ignore) printf(" after %u", watch->ignore);
+            print_condition(&watch->condition);
+            printf("\n");
+        }
+    }
+}
+
+static void dump_memory(char** saveptr) {
+    uint16_t addr = 0;
+    uint32_t length = 16;
+    if (!parse_address(strtok_r(NULL, " \t\n", saveptr), &addr)) {
+        return;
+    }
+    parse_number(strtok_r(NULL, " \t\n", saveptr), &length);
+
+    for (uint32_t offset = 0; offset < length && addr + offset < MAX_MEMORY; offset++) {
+        if (offset % 16 == 0) {
+            printf(offset ? "\n$%04X:" : "$%04X:", addr + offset);
+        }
+        printf(" %02X", peek_memory(addr + offset));
+    }
+    printf("\n");
+}
+
+static void set_value(char** saveptr) {
+    char* target = strtok_r(NULL, " \t\n", saveptr);
+    uint32_t value = 0;
+    uint8_t reg = 0;
+    uint16_t addr = 0;
+
+    if (!target || !parse_number(strtok_r(NULL, " \t\n", saveptr), &value)) {
+        puts("set REGISTER|pc|x|y|ADDR VALUE");
+        return;
+    }
+
+    if (strcasecmp(target, "pc") == 0) {
+        vm.pc = (uint16_t)value;
+    } else if (strcasecmp(target, "x") == 0) {
+        vm.x = (uint16_t)value;
+    } else if (strcasecmp(target, "y") == 0) {
+        vm.y = (uint16_t)value;
+    } else if (parse_register(target, &reg)) {
+        set_register(reg, (uint8_t)value);
+    } else if (parse_address(target, &addr)) {
+        breakpoint_t* breakpoint = find_breakpoint(addr);
+        if (breakpoint) {
+            breakpoint->original = (uint8_t)value;
+        } else {
+            system_write_byte(addr, (uint8_t)value);
+        }
+    }
+}
+
+static void step(char** saveptr) {
+    uint32_t count = 1;
+    parse_number(strtok_r(NULL, " \t\n", saveptr), &count);
+
+    vm.stepping = true;
+    for (uint32_t i = 0; i < count && vm.running; i++) {
+        cpu_cycle();
+        steps_taken++;
+    }
+    vm.stepping = false;
+    print_debug();
+}
+
+static void print_help() {
+    puts("  break ADDR [after N] [if COND]             stop before the instruction at ADDR");
+    puts("  watch r|w|rw ADDR [LEN] [after N] [if COND] stop after an access to ADDR..ADDR+LEN-1");
+    puts("  delete N / unwatch N                       remove a breakpoint / watchpoint");
+    puts("  list                                       show breakpoints and watchpoints");
+    puts("  step [N]                                   run N instructions");
+    puts("  continue                                   resume");
+    puts("  regs                                       show registers");
+    puts("  mem ADDR [LEN]                             dump memory");
+    puts("  set REGISTER|pc|x|y|ADDR VALUE             change a register or byte");
+    puts("  quit                                       stop the VM");
+    puts("  COND is LHS OP VALUE, LHS one of r0-r7, st, as, ds, xl, xh, yl, yh, pc, x, y, [ADDR],");
+    puts("  or value (the byte a watchpoint saw); OP one of == != < <= > >=");
+}
+
+// Runs one console command, returns true when execution should resume.
+bool debug_command(const char* line) {
+    char buffer[256];
+    char* saveptr = NULL;
+    snprintf(buffer, sizeof(buffer), "%s", line);
+
+    char* command = strtok_r(buffer, " \t\n", &saveptr);
+    if (!command) {
+        return false;
+    }
+
+    if (strcmp(command, "break") == 0 || strcmp(command, "b") == 0) {
+        add_breakpoint(&saveptr);
+    } else if (strcmp(command, "watch") == 0 || strcmp(command, "w") == 0) {
+        add_watchpoint(&saveptr);
+    } else if (strcmp(command, "delete") == 0 || strcmp(command, "d") == 0) {
+        delete_point(&saveptr, false);
+    } else if (strcmp(command, "unwatch") == 0) {
+        delete_point(&saveptr, true);
+    } else if (strcmp(command, "list") == 0 || strcmp(command, "l") == 0) {
+        list_points();
+    } else if (strcmp(command, "step") == 0 || strcmp(command, "s") == 0) {
+        step(&saveptr);
+    } else if (strcmp(command, "continue") == 0 || strcmp(command, "c") == 0) {
+        return true;
+    } else if (strcmp(command, "regs") == 0 || strcmp(command, "r") == 0) {
+        print_debug();
+    } else if (strcmp(command, "mem") == 0 || strcmp(command, "m") == 0) {
+        dump_memory(&saveptr);
+    } else if (strcmp(command, "set") == 0) {
+        set_value(&saveptr);
+    } else if (strcmp(command, "quit") == 0 || strcmp(command, "q") == 0) {
+        vm.running = false;
+        return true;
+    } else if (strcmp(command, "help") == 0 || strcmp(command, "h") == 0) {
+        print_help();
+    } else {
+        printf("Unknown command %s, try help\n", command);
+    }
+    return false;
+}
+
+void debug_console() {
+    char line[256];
+
+    if (stop_reason[0]) {
+        printf("Stopped: %s\n", stop_reason);
+        stop_reason[0] = '\0';
+    }
+    print_debug();
+
+    while (console_open && vm.running) {
+        printf("(tvm) ");
+        fflush(stdout);
+
+        if (!fgets(line, sizeof(line), stdin)) {
+            // nobody to answer, let the program run on
+            console_open = false;
+            break;
+        }
+        if (debug_command(line)) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OP_BREAKPOINT 0xFD      // patched over the opcode at each breakpoint
+#define MAX_BREAKPOINTS 32
+#define MAX_WATCHPOINTS 32
+
+// vm.page_flags bits
+enum {
+    PAGE_BREAKPOINT = 1,        // reads and writes must see the original opcode
+    PAGE_WATCH_READ = 2,
+    PAGE_WATCH_WRITE = 4,
+};
+
+typedef enum {
+    COND_ALWAYS,
+    COND_REGISTER,      // operand is a register number
+    COND_MEMORY,        // operand is an address
+    COND_VALUE,         // the byte a watchpoint saw
+    COND_PC,
+    COND_X,
+    COND_Y,
+} debug_condition_source_t;
+
+typedef enum {
+    COND_EQ,
+    COND_NE,
+    COND_LT,
+    COND_LE,
+    COND_GT,
+    COND_GE,
+} debug_condition_op_t;
+
+typedef struct {
+    debug_condition_source_t source;
+    uint16_t operand;
+    debug_condition_op_t op;
+    uint16_t value;
+} debug_condition_t;
+
+typedef struct {
+    bool active;
+    uint16_t addr;
+    uint8_t original;       // opcode hidden under OP_BREAKPOINT
+    uint32_t hits;
+    uint32_t ignore;        // hits to let through before stopping
+    debug_condition_t condition;
+} breakpoint_t;
+
+typedef struct {
+    bool active;
+    uint16_t start;
+    uint32_t end;           // exclusive
+    uint8_t access;         // PAGE_WATCH_READ and/or PAGE_WATCH_WRITE
+    uint32_t hits;
+    uint32_t ignore;
+    debug_condition_t condition;
+} watchpoint_t;
+
+void debug_enable_interrupt();
+bool debug_command(const char* line);
+void debug_console();
+
+// set by SIGINT once debug_enable_interrupt has run, cpu_cycle polls it
+extern volatile sig_atomic_t debug_interrupted;
+
+// hooks called by the CPU
+void debug_breakpoint();
+void debug_trap();
+uint8_t debug_read_byte(uint16_t addr);
+void debug_write_byte(uint16_t addr, uint8_t value);
+uint64_t debug_hash_memory(uint64_t hash);
@@ -0,0 +1,85 @@
+#include "vm_replay.h"
+
+#include <string.h>
+
+static void write_u32(uint8_t* out, uint32_t value) {
+    out[0] = value & 0xFF;
+    out[1] = (value >> 8) & 0xFF;
+    out[2] = (value >> 16) & 0xFF;
+    out[3] = (value >> 24) & 0xFF;
+}
+
+static uint32_t read_u32(const uint8_t* in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+bool replay_open_record(vm_replay_t* replay, const char* filename, uint32_t cycles_per_frame) {
+    replay->file = fopen(filename, "wb");
+    if (!replay->file) {
+        printf("Could not open %s for recording\n", filename);
+        return false;
+    }
+
+    replay->recording = true;
+    replay->cycles_per_frame = cycles_per_frame;
+    replay->frame = 0;
+
+    // header: magic, version, cycles per frame (little endian)
+    uint8_t header[9];
+    memcpy(header, REPLAY_MAGIC, 4);
+    header[4] = REPLAY_VERSION;
+    write_u32(header + 5, cycles_per_frame);
+    return fwrite(header, sizeof(header), 1, replay->file) == 1;
+}
+
+bool replay_open_playback(vm_replay_t* replay, const char* filename) {
+    replay->file = fopen(filename, "rb");
+    if (!replay->file) {
+        printf("Could not open recording %s\n", filename);
+        return false;
+    }
+
+    uint8_t header[9];
+    if (fread(header, sizeof(header), 1, replay->file) != 1
+        || memcmp(header, REPLAY_MAGIC, 4) != 0
+        || header[4] != REPLAY_VERSION) {
+        printf("%s is not a TangoVM input recording\n", filename);
+        replay_close(replay);
+        return false;
+    }
+
+    replay->recording = false;
+    replay->cycles_per_frame = read_u32(header + 5);
+    replay->frame = 0;
+    return true;
+}
+
+void replay_close(vm_replay_t* replay) {
+    if (replay->file) {
+        fclose(replay->file);
+        replay->file = NULL;
+    }
+}
+
+bool replay_write_frame(vm_replay_t* replay, const uint8_t controllers[REPLAY_CONTROLLERS]) {
+    replay->frame++;
+    return fwrite(controllers, REPLAY_CONTROLLERS, 1, replay->file) == 1;
+}
+
+bool replay_read_frame(vm_replay_t* replay, uint8_t controllers[REPLAY_CONTROLLERS]) {
+    if (fread(controllers, REPLAY_CONTROLLERS, 1, replay->file) != 1) {
+        return false;
+    }
+    replay->frame++;
+    return true;
+}
+
+// 64-bit FNV-1a, chained through `hash` so several buffers can be combined
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t nbytes) {
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < nbytes; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Input recordings store a small header followed by one entry per frame
+// holding the value of each controller register at the start of that frame.
+#define REPLAY_MAGIC "TVMR"
+#define REPLAY_VERSION 1
+#define REPLAY_CONTROLLERS 2
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+
+typedef struct {
+    FILE* file;
+    bool recording;
+    uint32_t cycles_per_frame;
+    uint32_t frame;
+} vm_replay_t;
+
+bool replay_open_record(vm_replay_t* replay, const char* filename, uint32_t cycles_per_frame);
+bool replay_open_playback(vm_replay_t* replay, const char* filename);
+void replay_close(vm_replay_t* replay);
+
+bool replay_write_frame(vm_replay_t* replay, const uint8_t controllers[REPLAY_CONTROLLERS]);
+bool replay_read_frame(vm_replay_t* replay, uint8_t controllers[REPLAY_CONTROLLERS]);
+
+uint64_t hash_bytes(uint64_t hash, const void* data, size_t nbytes);
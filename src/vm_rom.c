@@ -0,0 +1,315 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "vm_rom.h"
+#include "vm_cpu.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool map_rom_file(const char* filename, vm_rom_file_t* rom) {
+    rom->data = NULL;
+    rom->size = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Could not open %s\n", filename);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        printf("Could not read size of %s\n", filename);
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        printf("Could not map %s\n", filename);
+        return false;
+    }
+
+    rom->data = data;
+    rom->size = (size_t)st.st_size;
+    return true;
+}
+
+void unmap_rom_file(vm_rom_file_t* rom) {
+    if (rom->data) {
+        munmap(rom->data, rom->size);
+        rom->data = NULL;
+        rom->size = 0;
+    }
+}
+
+static bool read_hex_value(FILE* file, uint32_t* value) {
+    if (feof(file)) return false;
+    int c = 0;
+    int i = 0;
+    char buffer[16];
+    while (i < 14 && (c = getc(file)) != EOF) {
+        if (!isxdigit(c)) {
+            ungetc(c, file);
+            break;
+        }
+        buffer[i++] = (char)c;
+    }
+    buffer[i] = '\0';
+    if (strnlen(buffer, 16) == 0) {
+        return false;
+    }
+    return sscanf(buffer, "%X", value);
+}
+
+static void load_hex_rom(FILE* fp, uint8_t* memory) {
+    while (!feof(fp)) {
+        uint32_t value;
+        if (read_hex_value(fp, &value)) {
+            uint16_t addr = (uint16_t)value;
+            int c = getc(fp);
+            while (c != '\n' && c != EOF) {
+                if (c != ' ' && c != ':') {
+                    ungetc(c, fp);
+                }
+                if (read_hex_value(fp, &value)) {
+                    memory[addr++] = value;
+                }
+                c = getc(fp);
+            }
+        }
+    }
+}
+
+static uint32_t read_u32(const uint8_t* in) {
+    return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static bool read_length(const uint8_t** in, const uint8_t* end, uint32_t* length) {
+    uint8_t extra = 0;
+    do {
+        if (*in >= end) {
+            return false;
+        }
+        extra = *(*in)++;
+        *length += extra;
+    } while (extra == 0xFF);
+    return true;
+}
+
+// Each sequence is a token byte (literal count in the high nibble, match
+// length - 4 in the low one, 15 meaning more length bytes follow), the
+// literals, then a u16 LE offset back into the output. The last sequence has
+// literals only. Matches may overlap their own output, which is how runs of
+// one byte are stored.
+static bool decompress_lz(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size) {
+    const uint8_t* in_end = in + in_size;
+    uint8_t* out_start = out;
+    uint8_t* out_end = out + out_size;
+
+    while (in < in_end) {
+        uint8_t token = *in++;
+
+        uint32_t literals = token >> 4;
+        if (literals == 15 && !read_length(&in, in_end, &literals)) {
+            return false;
+        }
+        if (literals > (size_t)(in_end - in) || literals > (size_t)(out_end - out)) {
+            return false;
+        }
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+
+        if (in == in_end) {
+            break;
+        }
+
+        if (in_end - in < 2) {
+            return false;
+        }
+        uint16_t offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        uint32_t length = token & 0x0F;
+        if (length == 15 && !read_length(&in, in_end, &length)) {
+            return false;
+        }
+        length += 4;
+
+        if (offset == 0 || offset > out - out_start || length > (size_t)(out_end - out)) {
+            return false;
+        }
+        const uint8_t* match = out - offset;
+        if (offset >= length) {
+            memcpy(out, match, length);
+            out += length;
+        } else {
+            while (length--) {
+                *out++ = *match++;
+            }
+        }
+    }
+    return out == out_end;
+}
+
+static bool load_packed_rom(const vm_rom_file_t* rom, uint8_t* memory) {
+    const uint8_t* in = rom->data + ROM_HEADER_SIZE;
+    const uint8_t* end = rom->data + rom->size;
+
+    if (rom->size < ROM_HEADER_SIZE || rom->data[4] != ROM_VERSION) {
+        printf("Unsupported packed ROM version\n");
+        return false;
+    }
+
+    uint16_t section_count = rom->data[6] | (rom->data[7] << 8);
+    for (uint16_t i = 0; i < section_count; i++) {
+        if (end - in < ROM_SECTION_HEADER_SIZE) {
+            printf("ROM section %d is truncated\n", i);
+            return false;
+        }
+        uint16_t addr = in[0] | (in[1] << 8);
+        uint8_t encoding = in[2];
+        uint32_t size = read_u32(in + 4);
+        uint32_t stored_size = read_u32(in + 8);
+        in += ROM_SECTION_HEADER_SIZE;
+
+        if (stored_size > (size_t)(end - in) || addr + size > MAX_MEMORY) {
+            printf("ROM section %d at $%04X is truncated or runs past memory\n", i, addr);
+            return false;
+        }
+
+        bool ok = false;
+        if (encoding == ROM_SECTION_RAW) {
+            ok = stored_size == size;
+            if (ok) {
+                memcpy(memory + addr, in, size);
+            }
+        } else if (encoding == ROM_SECTION_LZ) {
+            ok = decompress_lz(in, stored_size, memory + addr, size);
+        }
+        if (!ok) {
+            printf("ROM section %d at $%04X is corrupt\n", i, addr);
+            return false;
+        }
+        in += stored_size;
+    }
+    return true;
+}
+
+bool is_memory_image(const char* filename) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        return false;
+    }
+    char magic[4];
+    bool image = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+        && memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+    fclose(fp);
+    return image;
+}
+
+uint8_t* map_memory_image(const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Could not open %s\n", filename);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size != IMAGE_HEADER_SIZE + MAX_MEMORY) {
+        printf("%s is not a memory image\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    // writable but private, a write copies the page for this process only
+    uint8_t* data = mmap(NULL, IMAGE_HEADER_SIZE + MAX_MEMORY, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        printf("Could not map %s\n", filename);
+        return NULL;
+    }
+
+    if (memcmp(data, IMAGE_MAGIC, 4) != 0 || data[4] != IMAGE_VERSION || read_u32(data + 8) != MAX_MEMORY) {
+        printf("Unsupported memory image version\n");
+        munmap(data, IMAGE_HEADER_SIZE + MAX_MEMORY);
+        return NULL;
+    }
+    return data + IMAGE_HEADER_SIZE;
+}
+
+void unmap_memory_image(uint8_t* memory) {
+    if (memory) {
+        munmap(memory - IMAGE_HEADER_SIZE, IMAGE_HEADER_SIZE + MAX_MEMORY);
+    }
+}
+
+bool write_memory_image(const char* filename, const uint8_t* memory) {
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        printf("Could not open %s\n", filename);
+        return false;
+    }
+
+    uint8_t header[IMAGE_HEADER_SIZE] = { 0 };
+    memcpy(header, IMAGE_MAGIC, 4);
+    header[4] = IMAGE_VERSION;
+    for (int i = 0; i < 4; i++) {
+        header[8 + i] = (uint8_t)(MAX_MEMORY >> (8 * i));
+    }
+
+    bool ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header)
+        && fwrite(memory, 1, MAX_MEMORY, fp) == MAX_MEMORY;
+    if (fclose(fp) != 0 || !ok) {
+        printf("Could not write %s\n", filename);
+        return false;
+    }
+    return true;
+}
+
+bool load_rom(const char* filename, uint8_t* memory) {
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        printf("Could not open %s\n", filename);
+        return false;
+    }
+
+    if (is_memory_image(filename)) {
+        fclose(fp);
+        uint8_t* image_memory = map_memory_image(filename);
+        if (!image_memory) {
+            return false;
+        }
+        memcpy(memory, image_memory, MAX_MEMORY);
+        unmap_memory_image(image_memory);
+        return true;
+    }
+
+    char magic[4];
+    bool packed = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+        && memcmp(magic, ROM_MAGIC, sizeof(magic)) == 0;
+
+    if (!packed) {
+        rewind(fp);
+        load_hex_rom(fp, memory);
+        fclose(fp);
+        return true;
+    }
+    fclose(fp);
+
+    vm_rom_file_t rom;
+    if (!map_rom_file(filename, &rom)) {
+        return false;
+    }
+    bool ok = load_packed_rom(&rom, memory);
+    unmap_rom_file(&rom);
+    return ok;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A read-only view of a ROM file. The file is memory mapped, so opening it
+// costs the same regardless of size and pages are only read when touched.
+typedef struct {
+    uint8_t* data;
+    size_t size;
+} vm_rom_file_t;
+
+// Packed ROMs start with this magic, then a u16 LE section count. Each section
+// is a u16 LE load address, an encoding byte, a reserved byte, a u32 LE size
+// in memory and a u32 LE stored size, followed by the stored bytes. Anything
+// else is loaded as hex text ("ADDR: XX XX ...") unless it is a memory image.
+#define ROM_MAGIC "TROM"
+#define ROM_VERSION 1
+#define ROM_HEADER_SIZE 8
+#define ROM_SECTION_HEADER_SIZE 12
+
+enum {
+    ROM_SECTION_RAW = 0,
+    ROM_SECTION_LZ = 1,     // LZ4 style sequences, see decompress_lz
+};
+
+bool map_rom_file(const char* filename, vm_rom_file_t* rom);
+void unmap_rom_file(vm_rom_file_t* rom);
+
+bool load_rom(const char* filename, uint8_t* memory);
+
+// A memory image is a whole address space at power on, ROM loaded, so it can
+// be mapped instead of loaded: a header page (this magic, a version byte, three
+// reserved bytes and a u32 LE memory size) padded to IMAGE_HEADER_SIZE, then
+// MAX_MEMORY bytes. The memory starts on a page boundary and is mapped
+// private, so every instance running the image shares its pages with the
+// page cache and only copies the ones it writes.
+#define IMAGE_MAGIC "TIMG"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 0x1000
+
+bool is_memory_image(const char* filename);
+uint8_t* map_memory_image(const char* filename);
+void unmap_memory_image(uint8_t* memory);
+bool write_memory_image(const char* filename, const uint8_t* memory);
@@ -5,12 +5,11 @@
 #include <SDL.h>
 
 #include "vm_cpu.h"
+#include "vm_capture.h"
+#include "vm_replay.h"
+#include "vm_rom.h"
 
-typedef struct {
-    uint8_t r;
-    uint8_t g;
-    uint8_t b;
-} palette_color_t;
+#define FRAME_RATE 60
 
 typedef struct {
     SDL_Window* window;
@@ -19,6 +18,15 @@ typedef struct {
     int screen_width;
     int screen_height;
     int screen_zoom;
+
+    bool headless;          // no window, frames run back to back
+    bool deterministic;     // fixed cycle budget per frame instead of wall clock
+    uint32_t max_frames;    // stop after this many frames (0 = no limit)
+    vm_replay_t replay;     // input recording being written or played back
+    FILE* hash_file;        // per-frame memory/framebuffer hashes go here
+    FILE* trace_file;       // address and cycles of every instruction go here
+    vm_capture_t capture;   // composed frames streamed to a video file or pipe
+    uint8_t* memory_image;  // mapped memory image vm.memory points into, NULL when running from RAM
 } vm_host_t;
 
 extern vm_host_t vm_host;
@@ -26,7 +34,5 @@ extern vm_host_t vm_host;
 void init_system();
 void start_system_loop();
 void cleanup_system();
-
-uint8_t system_read_byte(uint16_t addr);
-uint16_t system_read_word(uint16_t addr);
-void system_write_byte(uint16_t addr, uint8_t value);
+bool start_capture(const char* filename, capture_format_t format);
+bool load_bank_file(const char* filename);
@@ -0,0 +1,10 @@
+step
+step
+step
+step
+step
+step
+step
+step
+step
+quit
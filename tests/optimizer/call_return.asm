@@ -0,0 +1,7 @@
+    .org $0200
+start:
+    jsr foo
+Lx: inc r0
+    ret
+foo:
+    ret
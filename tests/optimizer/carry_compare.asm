@@ -0,0 +1,6 @@
+    .org $0200
+start:
+    dec r0
+    cmp r0, #0
+Lx: adc r1, #0
+    end
@@ -0,0 +1,8 @@
+    .org $0200
+start:
+    inc r0
+    jmp start
+    inc r1
+    mov r2, #5
+done:
+    end
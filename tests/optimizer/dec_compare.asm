@@ -0,0 +1,8 @@
+    .org $0200
+start:
+    mov r0, #3
+loop:
+    dec r0
+    cmp r0, #0
+    bne loop
+    end
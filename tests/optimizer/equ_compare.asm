@@ -0,0 +1,10 @@
+    .equ COUNT #2 * 4
+    .equ NONE COUNT - 8
+    .org $0200
+start:
+    mov r0, COUNT
+loop:
+    dec r0
+    cmp r0, NONE
+    bne loop
+    end
@@ -0,0 +1,14 @@
+    .org $0200
+start:
+    jsr first
+    end
+first:
+    inc r0
+    jsr second
+    ret
+other:
+    inc r2
+    ret
+second:
+    inc r1
+    ret
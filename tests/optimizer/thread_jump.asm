@@ -0,0 +1,6 @@
+    .org $0200
+start:
+    jmp Lx
+    end
+Lx: inc r0
+    jmp start
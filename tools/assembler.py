@@ -1,7 +1,16 @@
 import argparse
+import os
 from enum import Enum
 import re
-from typing import List, Optional
+from typing import Dict, List, Optional, Tuple
+
+from cycle_table import instruction_cycles
+from rom_format import read_rom, write_rom
+
+# game console bank window, see BANK_SELECT0/1 in vm_system.c
+BANK_SIZE = 0x2000
+BANK_WINDOW_START = 0x8000
+BANK_WINDOW_END = 0xC000
 
 class TokenType(Enum):
     OP_CODE = 1
@@ -14,6 +23,7 @@ class TokenType(Enum):
     LABEL_DEF = 8
     DIRECTIVE = 9
     EQU_DEF = 10
+    EXPRESSION = 11
 
 class Token:
     def __init__(self, token_type: TokenType, value):
@@ -21,7 +31,7 @@ class Token:
         self.value = value
 
     def __repr__(self):
-        if self.type in [TokenType.LABEL, TokenType.LABEL_DEF, TokenType.DIRECTIVE, TokenType.EQU_DEF]:
+        if self.type in [TokenType.LABEL, TokenType.LABEL_DEF, TokenType.DIRECTIVE, TokenType.EQU_DEF, TokenType.EXPRESSION]:
             return f'{str(self.type)[10:]}("{self.value}")'
         return f'{str(self.type)[10:]}(${self.value:02X})'
 
@@ -59,6 +69,7 @@ class Directive(Enum):
     DECL_BYTE = '.byte'
     EQU = '.equ'
     ORG = '.org'
+    BANK = '.bank'
 
 directive_map = [e.value for e in Directive]
 
@@ -158,10 +169,127 @@ def process_word(word: str, first_token: Optional[Token]) -> Optional[Token]:
 
     return None
 
+EXPRESSION_OPERATORS = re.compile(r'[-+*/%&|^~()]|<<|>>')
+EXPRESSION_TOKEN = re.compile(r'\s*(\$[0-9a-fA-F]+|\d+|[a-zA-Z_]\w*|<<|>>|[-+*/%&|^~()])')
+
+class ConstantFolder:
+    """Evaluates the constant expression on the right of an .equ, e.g.
+    `.equ B_UPDOWN B_UP | B_DOWN` or `.equ ROW2 $F800 + 32 * 2`. Names refer
+    to earlier .equ values. A leading # (or any immediate operand) makes the
+    result an immediate, otherwise it is an address."""
+
+    binary_levels = [['|'], ['^'], ['&'], ['<<', '>>'], ['+', '-'], ['*', '/', '%']]
+
+    def __init__(self, text: str, equivalents):
+        self.equivalents = equivalents
+        self.is_immediate = text.startswith('#')
+        text = text[1:] if self.is_immediate else text
+
+        self.words = []
+        pos = 0
+        text = text.rstrip()
+        while pos < len(text):
+            match = EXPRESSION_TOKEN.match(text, pos)
+            if not match:
+                raise ValueError(f'unexpected "{text[pos:].strip()}"')
+            self.words.append(match.group(1))
+            pos = match.end()
+        self.index = 0
+
+    def fold(self) -> Token:
+        value = self.binary(0)
+        if self.index != len(self.words):
+            raise ValueError(f'unexpected "{self.words[self.index]}"')
+
+        mask = 0xFF if self.is_immediate else 0xFFFF
+        if not -(mask + 1) <= value <= mask:
+            raise ValueError(f'value {value} out of range')
+        return Token(TokenType.IMMEDIATE if self.is_immediate else TokenType.ADDRESS, value & mask)
+
+    def peek(self) -> Optional[str]:
+        return self.words[self.index] if self.index < len(self.words) else None
+
+    def binary(self, level: int) -> int:
+        if level == len(self.binary_levels):
+            return self.unary()
+        value = self.binary(level + 1)
+        while self.peek() in self.binary_levels[level]:
+            op = self.words[self.index]
+            self.index += 1
+            right = self.binary(level + 1)
+            if op in ['/', '%'] and right == 0:
+                raise ValueError('division by zero')
+            value = {
+                '|': lambda: value | right, '^': lambda: value ^ right, '&': lambda: value & right,
+                '<<': lambda: value << right, '>>': lambda: value >> right,
+                '+': lambda: value + right, '-': lambda: value - right,
+                '*': lambda: value * right, '/': lambda: value // right, '%': lambda: value % right,
+            }[op]()
+        return value
+
+    def unary(self) -> int:
+        word = self.peek()
+        if word in ['-', '~', '+']:
+            self.index += 1
+            value = self.unary()
+            return {'-': -value, '~': ~value, '+': value}[word]
+        return self.primary()
+
+    def primary(self) -> int:
+        word = self.peek()
+        if word is None:
+            raise ValueError('expression ends early')
+        self.index += 1
+
+        if word == '(':
+            value = self.binary(0)
+            if self.peek() != ')':
+                raise ValueError('missing ")"')
+            self.index += 1
+            return value
+        if word.startswith('$'):
+            return int(word[1:], 16)
+        if word.isdigit():
+            return int(word, 10)
+        if word in self.equivalents:
+            token = self.equivalents[word]
+            if token.type == TokenType.IMMEDIATE:
+                self.is_immediate = True
+            elif token.type != TokenType.ADDRESS:
+                raise ValueError(f'"{word}" is not a number')
+            return token.value
+        raise ValueError(f'"{word}" is not a known .equ')
+
+def process_equ_expression(words: List[str]) -> Optional[List[Token]]:
+    # .equ NAME <expression>; plain single values still go through process_word
+    expression = ' '.join(words[2:]).split(';')[0].strip()
+    if not expression:
+        return None
+
+    is_expression = ' ' in expression or EXPRESSION_OPERATORS.search(expression.lstrip('#'))
+    if not is_expression:
+        equ_token = Token(TokenType.DIRECTIVE, Directive.EQU.value)
+        value_token = process_word(expression, equ_token)
+        is_expression = value_token is not None and value_token.type == TokenType.EQU_DEF
+
+    if not is_expression:
+        return None
+
+    return [
+        Token(TokenType.DIRECTIVE, Directive.EQU.value),
+        Token(TokenType.EQU_DEF, words[1]),
+        Token(TokenType.EXPRESSION, expression),
+    ]
+
 def process_line(line: str) -> List[Token]:
     output: List[Token] = []
     words = list(filter(lambda w: len(w) > 0, line.split(' ')))
     first_token = None
+
+    if len(words) > 2 and words[0].lower() == Directive.EQU.value:
+        expression_tokens = process_equ_expression(words)
+        if expression_tokens:
+            return expression_tokens
     for word in words:
         token = process_word(word, first_token)
         
@@ -176,160 +304,490 @@ def process_line(line: str) -> List[Token]:
         output.append(token)
     return output
 
+OP_JMP = instruction_map['jmp']
+OP_JSR = instruction_map['jsr']
+OP_RET = instruction_map['ret']
+OP_END = instruction_map['end']
+OP_CMP = instruction_map['cmp']
+BRANCH_OPS = [instruction_map[op] for op in ['beq', 'bne', 'blt', 'ble', 'bgt', 'bge']]
+CARRY_BRANCH_OPS = [instruction_map[op] for op in ['blt', 'ble', 'bgt', 'bge']]
+# set Z/N/C from their result without reading C
+FLAG_SETTING_OPS = [instruction_map[op] for op in ['add', 'sub', 'cmp', 'and', 'or', 'inc', 'dec', 'not']]
+# leave C=0, exactly like cmp reg, #0 would
+CARRY_CLEARING_OPS = [instruction_map[op] for op in ['and', 'or', 'not']]
+# may leave C=1 where cmp reg, #0 would not
+CARRY_SETTING_OPS = [instruction_map[op] for op in ['add', 'adc', 'sub', 'sbb', 'inc', 'dec']]
+CARRY_READING_OPS = [instruction_map[op] for op in ['adc', 'sbb', 'dbg']]
+
+# from cycle_table.py, which mirrors the cycle charges in vm_cpu.c
+JMP_CYCLES = instruction_cycles(bytes([OP_JMP, 0, 0]))
+JSR_CYCLES = instruction_cycles(bytes([OP_JSR, 0, 0]))
+RET_CYCLES = instruction_cycles(bytes([OP_RET]))
+CMP_IMMEDIATE_CYCLES = instruction_cycles(bytes([OP_CMP + 0x20, 0, 0]))
+
+def token_size(token: Token) -> int:
+    if token.type in [TokenType.ADDRESS, TokenType.INDIRECT]:
+        return 2
+    if token.type == TokenType.LABEL:
+        return 1 if is_half_label(token.value) else 2
+    if token.type in [TokenType.OP_CODE, TokenType.REGISTER, TokenType.IMMEDIATE]:
+        return 1
+    return 0
+
+class PeepholeOptimizer:
+    """Optional pass over the token stream, run before addresses are assigned.
+
+    - jsr X followed by ret becomes jmp X
+    - jumps, branches and calls to a label holding `jmp Y` go straight to Y
+    - a jmp to the very next instruction is removed
+    - cmp reg, #0 is removed after an instruction that already set Z/N from
+      reg, as long as the carry it would have cleared is never read
+    - instructions after jmp/ret/end are removed up to the next label or
+      directive; code is assumed to be entered only through labels
+    """
+
+    def __init__(self, lines, verbose: bool = False):
+        self.lines = lines
+        self.verbose = verbose
+        self.equivalents = {}
+        self.stats = {}
+
+        for _, tokens in lines:
+            if len(tokens) == 3 and tokens[1].type == TokenType.EQU_DEF:
+                if tokens[2].type == TokenType.EXPRESSION:
+                    try:
+                        self.equivalents[tokens[1].value] = ConstantFolder(tokens[2].value, self.equivalents).fold()
+                    except ValueError:
+                        pass
+                else:
+                    self.equivalents[tokens[1].value] = tokens[2]
+
+    def record(self, index: int, rule: str, nbytes: int, cycles: int):
+        count, total_bytes, total_cycles = self.stats.get(rule, (0, 0, 0))
+        self.stats[rule] = (count + 1, total_bytes + nbytes, total_cycles + cycles)
+        if self.verbose:
+            print(f'{self.lines[index][0]}: {rule}')
+
+    def tokens(self, index: int) -> List[Token]:
+        return self.lines[index][1]
+
+    def remove(self, index: int):
+        # labels stay behind, other code may still jump to them
+        line_no, tokens = self.lines[index]
+        self.lines[index] = (line_no, [t for t in tokens if t.type == TokenType.LABEL_DEF])
+
+    def resolve(self, token: Token) -> Token:
+        if token.type == TokenType.LABEL and token.value in self.equivalents:
+            return self.equivalents[token.value]
+        return token
+
+    def opcode_position(self, index: int) -> Optional[int]:
+        # labels may share a line with the instruction they mark (`loop: inc r0`)
+        tokens = self.tokens(index)
+        position = 0
+        while position < len(tokens) and tokens[position].type == TokenType.LABEL_DEF:
+            position += 1
+        if position < len(tokens) and tokens[position].type == TokenType.OP_CODE:
+            return position
+        return None
+
+    def instruction(self, index: int) -> List[Token]:
+        # the instruction on a line without the labels in front of it
+        position = self.opcode_position(index)
+        return self.tokens(index)[position:] if position is not None else []
+
+    def is_instruction(self, index: int) -> bool:
+        return self.opcode_position(index) is not None
+
+    def is_label_line(self, index: int) -> bool:
+        tokens = self.tokens(index)
+        return bool(tokens) and all(t.type == TokenType.LABEL_DEF for t in tokens)
+
+    def is_block_entry(self, index: int) -> bool:
+        # a labelled line can be reached from elsewhere, not only by falling through
+        tokens = self.tokens(index)
+        return bool(tokens) and tokens[0].type == TokenType.LABEL_DEF
+
+    def next_instruction(self, index: int) -> Optional[int]:
+        # the next instruction control falls through to, None if a directive is in the way
+        index += 1
+        while index < len(self.lines):
+            if self.is_instruction(index):
+                return index
+            if self.tokens(index) and not self.is_label_line(index):
+                return None
+            index += 1
+        return None
+
+    def label_target(self, token: Token) -> Optional[int]:
+        # first instruction at a plain label operand
+        if token.type != TokenType.LABEL or token.value in self.equivalents:
+            return None
+        if is_indirect_label(token.value) or is_half_label(token.value):
+            return None
+        for index, (_, tokens) in enumerate(self.lines):
+            if any(t.type == TokenType.LABEL_DEF and t.value == token.value for t in tokens):
+                return index if self.is_instruction(index) else self.next_instruction(index)
+        return None
+
+    def reads_status(self, tokens: List[Token]) -> bool:
+        op = tokens[0].value
+        if op in CARRY_READING_OPS or op in CARRY_BRANCH_OPS:
+            return True
+        return any(self.resolve(t).type == TokenType.REGISTER and self.resolve(t).value == special_registers['st']
+                   for t in tokens[1:])
+
+    def writes_carry(self, tokens: List[Token]) -> bool:
+        op = tokens[0].value
+        if op in [instruction_map['clc'], instruction_map['sec']]:
+            return True
+        if op not in FLAG_SETTING_OPS or len(tokens) < 2:
+            return False
+        dest = self.resolve(tokens[1])
+        # add/sub/... on x or y leave the flags alone
+        return dest.type == TokenType.REGISTER and dest.value not in [special_registers['x'], special_registers['y']]
+
+    def carry_live(self, index: Optional[int], visited) -> bool:
+        # can the carry at `index` be read before something overwrites it?
+        while index is not None and index < len(self.lines):
+            if not self.is_instruction(index):
+                if self.tokens(index) and not self.is_label_line(index):
+                    return True
+                index += 1
+                continue
+            if index in visited:
+                return False
+            visited.add(index)
+
+            tokens = self.instruction(index)
+            op = tokens[0].value
+            if self.reads_status(tokens) or op in [OP_JSR, OP_RET]:
+                return True
+            if op == OP_END or self.writes_carry(tokens):
+                return False
+            if op == OP_JMP or op in BRANCH_OPS:
+                target = self.label_target(tokens[1]) if len(tokens) > 1 else None
+                if target is None:
+                    return True
+                if op == OP_JMP:
+                    index = target
+                    continue
+                if self.carry_live(target, visited):
+                    return True
+            index += 1
+        return True
+
+    def fold_call_return(self) -> bool:
+        changed = False
+        for index in range(len(self.lines)):
+            tokens = self.instruction(index)
+            if not tokens or tokens[0].value != OP_JSR:
+                continue
+            after = self.next_instruction(index)
+            if after is not None and self.instruction(after)[0].value == OP_RET:
+                tokens[0].value = OP_JMP
+                self.record(index, 'jsr + ret -> jmp', 0, JSR_CYCLES + RET_CYCLES - JMP_CYCLES)
+                changed = True
+        return changed
+
+    def thread_jumps(self) -> bool:
+        changed = False
+        for index in range(len(self.lines)):
+            tokens = self.instruction(index)
+            if len(tokens) != 2:
+                continue
+            if tokens[0].value not in [OP_JMP, OP_JSR] + BRANCH_OPS:
+                continue
+            for _ in range(8):
+                target = self.label_target(tokens[1])
+                if target is None or target == index:
+                    break
+                target_tokens = self.instruction(target)
+                if target_tokens[0].value != OP_JMP or self.label_target(target_tokens[1]) in [None, target]:
+                    break
+                tokens[1] = Token(TokenType.LABEL, target_tokens[1].value)
+                self.tokens(index)[self.opcode_position(index) + 1] = tokens[1]
+                self.record(index, 'jump to jmp threaded', 0, JMP_CYCLES)
+                changed = True
+        return changed
+
+    def remove_jumps_to_next(self) -> bool:
+        changed = False
+        for index in range(len(self.lines)):
+            tokens = self.instruction(index)
+            if not tokens or tokens[0].value != OP_JMP or len(tokens) != 2:
+                continue
+            target = self.label_target(tokens[1])
+            if target is not None and target == self.next_instruction(index):
+                self.record(index, 'jmp to next instruction removed', 3, JMP_CYCLES)
+                self.remove(index)
+                changed = True
+        return changed
+
+    def remove_redundant_compares(self) -> bool:
+        changed = False
+        for index in range(1, len(self.lines)):
+            tokens = [self.resolve(t) for t in self.instruction(index)]
+            # a labelled cmp can be jumped to, past the instruction that set the flags
+            if not tokens or self.is_block_entry(index) or tokens[0].value != OP_CMP or len(tokens) != 3:
+                continue
+            reg, value = tokens[1], tokens[2]
+            if reg.type != TokenType.REGISTER or value.type != TokenType.IMMEDIATE or value.value != 0:
+                continue
+            if reg.value in [special_registers['st'], special_registers['x'], special_registers['y']]:
+                continue
+
+            # the previous instruction must flow straight into the cmp
+            previous = index - 1
+            while previous >= 0 and not self.tokens(previous):
+                previous -= 1
+            if previous < 0 or not self.is_instruction(previous):
+                continue
+            previous_tokens = self.instruction(previous)
+            op = previous_tokens[0].value
+            if len(previous_tokens) < 2 or self.resolve(previous_tokens[1]).type != TokenType.REGISTER:
+                continue
+            if self.resolve(previous_tokens[1]).value != reg.value:
+                continue
+
+            if op in CARRY_CLEARING_OPS:
+                pass
+            elif op not in CARRY_SETTING_OPS or self.carry_live(self.next_instruction(index), set()):
+                continue
+
+            self.record(index, 'redundant cmp reg, #0 removed', 3, CMP_IMMEDIATE_CYCLES)
+            self.remove(index)
+            changed = True
+        return changed
+
+    def remove_unreachable(self) -> bool:
+        changed = False
+        for index in range(len(self.lines)):
+            if not self.is_instruction(index) or self.instruction(index)[0].value not in [OP_JMP, OP_RET, OP_END]:
+                continue
+            after = index + 1
+            while after < len(self.lines):
+                if self.is_block_entry(after):
+                    break
+                if self.is_instruction(after):
+                    nbytes = sum(token_size(self.resolve(t)) for t in self.instruction(after))
+                    self.record(after, 'unreachable instruction removed', nbytes, 0)
+                    self.remove(after)
+                    changed = True
+                elif self.tokens(after):
+                    break
+                after += 1
+        return changed
+
+    def run(self):
+        passes = [
+            self.fold_call_return,
+            self.thread_jumps,
+            self.remove_jumps_to_next,
+            self.remove_redundant_compares,
+            self.remove_unreachable,
+        ]
+        changed = True
+        while changed:
+            changed = False
+            for optimization in passes:
+                changed = optimization() or changed
+
+    def print_report(self):
+        total_bytes = sum(nbytes for _, nbytes, _ in self.stats.values())
+        total_cycles = sum(cycles for _, _, cycles in self.stats.values())
+        print(f'Optimizer saved {total_bytes} bytes, ~{total_cycles} cycles (each instruction counted once)')
+        for rule, (count, nbytes, cycles) in self.stats.items():
+            print(f'  {rule}: {count}x, {nbytes} bytes, ~{cycles} cycles')
+
 def split_word_into_bytes(word: int):
     low = word & 0xFF
     high = word >> 8 & 0xFF
     return [low, high]
 
-def main():
-    parser = argparse.ArgumentParser(description='Assembler for a made-up instruction set')
-    parser.add_argument('source_file', metavar='source_file', type=str, help='ASM source file to assemble')
-    parser.add_argument('-v', '--verbose', dest='verbose', action='store_true')
-    parser.add_argument('-o', '--out', dest='out_file', metavar='output_file', default='default.rom')
-    parser.add_argument('-l', '--link', dest='linked_roms', metavar='rom_file', type=str, nargs='+',
-                        help='Additional rom files to link')
-    args = parser.parse_args()
-
+def assemble(lines, verbose: bool = False) -> Optional[Tuple[List[Tuple[int, Optional[int], bytes]], Dict[str, int]]]:
+    """Assigns addresses and encodes the processed lines. Returns (pc, bank, bytes)
+    for every line that produced data, and the label addresses, or None after
+    printing an error."""
     pc = 0
     equivalents = {}
     labels = {}
+    bank = None
+    bank_slot_start = BANK_WINDOW_START
+    # (start, end, line) of the bytes placed in each bank, as offsets into the
+    # bank, since both slots of a bank map to the same bytes of the .banks file
+    bank_ranges: Dict[int, List[Tuple[int, int, int]]] = {}
     output: List[List[Token]] = []
-    with open(args.source_file, 'r') as source:
-        for line_no, line in enumerate(source):
-            line = line.strip('\n')
-            tokens = process_line(line)
-
-            processed_tokens = []
-            equ_def = None
-            next_token_sets_pc = False
-            initial_pc = pc
-
-            for token in tokens:
-                if equ_def is not None:
-                    equivalents[equ_def] = token
-                    equ_def = None
-                elif next_token_sets_pc:
-                    if token.type not in [TokenType.ADDRESS, TokenType.IMMEDIATE]:
-                        print(f'{line_no}: Invalid value for .org')
-                        return
-                    if token.value < pc:
-                        print(f'{line_no}: Can only use .org to advance PC')
-                        return
-                    pc = token.value
-                    next_token_sets_pc = False
+
+    for line_no, tokens in lines:
+        processed_tokens = []
+        equ_def = None
+        next_token_sets_pc = False
+        next_token_sets_bank = False
+        initial_pc = pc
+
+        for token in tokens:
+            if equ_def is not None:
+                if token.type == TokenType.EXPRESSION:
+                    try:
+                        token = ConstantFolder(token.value, equivalents).fold()
+                    except ValueError as error:
+                        print(f'{line_no}: .equ {equ_def}: {error}')
+                        return None
+                equivalents[equ_def] = token
+                equ_def = None
+            elif next_token_sets_pc:
+                if token.type not in [TokenType.ADDRESS, TokenType.IMMEDIATE]:
+                    print(f'{line_no}: Invalid value for .org')
+                    return None
+                if token.value < pc:
+                    print(f'{line_no}: Can only use .org to advance PC')
+                    return None
+                if bank is not None and not BANK_WINDOW_START <= token.value < BANK_WINDOW_END:
+                    print(f'{line_no}: .org inside a bank must be between ${BANK_WINDOW_START:04X} and ${BANK_WINDOW_END - 1:04X}')
+                    return None
+                pc = token.value
+                bank_slot_start = pc - (pc - BANK_WINDOW_START) % BANK_SIZE
+                next_token_sets_pc = False
+                continue
+            elif next_token_sets_bank:
+                if token.type not in [TokenType.ADDRESS, TokenType.IMMEDIATE] or token.value > 0xFF:
+                    print(f'{line_no}: Invalid bank number')
+                    return None
+                bank = token.value
+                pc = BANK_WINDOW_START
+                bank_slot_start = pc
+                next_token_sets_bank = False
+                continue
+            elif token.type == TokenType.DIRECTIVE:
+                if token.value == Directive.ORG.value:
+                    next_token_sets_pc = True
+                    continue
+                elif token.value == Directive.BANK.value:
+                    next_token_sets_bank = True
                     continue
-                elif token.type == TokenType.DIRECTIVE:
-                    if token.value == Directive.ORG.value:
-                        next_token_sets_pc = True
-                        continue
-                elif token.type == TokenType.LABEL_DEF:
-                    if token.value in labels and labels[token.value] != -1:
-                            print(f'{line_no}: label "{token.value}" already defined!')
-                            return
+            elif token.type == TokenType.LABEL_DEF:
+                if token.value in labels and labels[token.value] != -1:
+                        print(f'{line_no}: label "{token.value}" already defined!')
+                        return None
+                else:
+                    labels[token.value.strip('[]')] = pc
+            elif token.type == TokenType.EQU_DEF:
+                equ_def = token.value
+            elif token.type == TokenType.LABEL:
+                if token.value in equivalents:
+                    equ_token = equivalents[token.value]
+                    token.type = equ_token.type
+                    token.value = equ_token.value
+
+                    if token.type in [TokenType.ADDRESS, TokenType.INDIRECT]:
+                        pc += 2
+                    elif token.type in [TokenType.IMMEDIATE, TokenType.REGISTER, TokenType.OP_CODE]:
+                        pc += 1
+                else:
+                    label: str = token.value
+                    is_indirect = is_indirect_label(label)
+                    label = label.strip('[]')
+                    if label in labels and labels[label] != -1:
+                        token.type = TokenType.INDIRECT if is_indirect else TokenType.ADDRESS
+                        token.value = labels[label]
                     else:
-                        labels[token.value.strip('[]')] = pc
-                elif token.type == TokenType.EQU_DEF:
-                    equ_def = token.value
-                elif token.type == TokenType.LABEL:
-                    if token.value in equivalents:
-                        equ_token = equivalents[token.value]
-                        token.type = equ_token.type
-                        token.value = equ_token.value
-
-                        if token.type in [TokenType.ADDRESS, TokenType.INDIRECT]:
-                            pc += 2
-                        elif token.type in [TokenType.IMMEDIATE, TokenType.REGISTER, TokenType.OP_CODE]:
-                            pc += 1
+                        labels[token.value] = -1
+                    
+                    if label.startswith('<') or label.startswith('>'):
+                        pc += 1
                     else:
-                        label: str = token.value
-                        is_indirect = is_indirect_label(label)
-                        label = label.strip('[]')
-                        if label in labels and labels[label] != -1:
-                            token.type = TokenType.INDIRECT if is_indirect else TokenType.ADDRESS
-                            token.value = labels[label]
-                        else:
-                            labels[token.value] = -1
-                        
-                        if label.startswith('<') or label.startswith('>'):
-                            pc += 1
-                        else:
-                            pc += 2
-                elif token.type not in [TokenType.DIRECTIVE, TokenType.ADDRESS, TokenType.INDIRECT]:
-                    pc += 1
-                elif token.type in [TokenType.ADDRESS, TokenType.INDIRECT]:
-                    pc += 2
-
-                if equ_def is not None and token.type != TokenType.EQU_DEF:
-                    print(f'{line_no}: equ "{equ_def}" not defined!')
-                    return
-
-                processed_tokens.append(token)
-
-            if processed_tokens:
-                # print(f'tokens: {processed_tokens}')
-                if processed_tokens[0].type == TokenType.OP_CODE:
-                    op = processed_tokens[0].value & 0xF
-                    if op in [2, 3, 4, 5, 7, 8]:
-                        if (len(processed_tokens) != 3 and op < 8) or (len(processed_tokens) != 2 and op == 8):
-                            print(f'{line_no}: Unknown mode based on operands')
-
-                        if op == 8:
-                            op_type1 = TokenType.REGISTER
-                            op_value1 = None
-                            op_type2 = processed_tokens[1].type
-                            op_value2 = processed_tokens[1].value
-                        else:
-                            op_type1 = processed_tokens[1].type
-                            op_value1 = processed_tokens[1].value
-                            op_type2 = processed_tokens[2].type
-                            op_value2 = processed_tokens[2].value
-
-                        if op_type1 == TokenType.REGISTER:
-                            pass
-                        elif op_type1 == TokenType.ADDRESS:
-                            processed_tokens[0].value += 0x40
-                        elif op_type1 == TokenType.INDIRECT:
+                        pc += 2
+            elif token.type not in [TokenType.DIRECTIVE, TokenType.ADDRESS, TokenType.INDIRECT]:
+                pc += 1
+            elif token.type in [TokenType.ADDRESS, TokenType.INDIRECT]:
+                pc += 2
+
+            if equ_def is not None and token.type != TokenType.EQU_DEF:
+                print(f'{line_no}: equ "{equ_def}" not defined!')
+                return None
+
+            processed_tokens.append(token)
+
+        if processed_tokens:
+            # print(f'tokens: {processed_tokens}')
+            if processed_tokens[0].type == TokenType.OP_CODE:
+                op = processed_tokens[0].value & 0xF
+                if op in [2, 3, 4, 5, 7, 8]:
+                    if (len(processed_tokens) != 3 and op < 8) or (len(processed_tokens) != 2 and op == 8):
+                        print(f'{line_no}: Unknown mode based on operands')
+
+                    if op == 8:
+                        op_type1 = TokenType.REGISTER
+                        op_value1 = None
+                        op_type2 = processed_tokens[1].type
+                        op_value2 = processed_tokens[1].value
+                    else:
+                        op_type1 = processed_tokens[1].type
+                        op_value1 = processed_tokens[1].value
+                        op_type2 = processed_tokens[2].type
+                        op_value2 = processed_tokens[2].value
+
+                    if op_type1 == TokenType.REGISTER:
+                        pass
+                    elif op_type1 == TokenType.ADDRESS:
+                        processed_tokens[0].value += 0x40
+                    elif op_type1 == TokenType.INDIRECT:
+                        processed_tokens[0].value += 0x80
+                    elif op_type1 == TokenType.LABEL:
+                        if is_indirect_label(op_value1):
                             processed_tokens[0].value += 0x80
-                        elif op_type1 == TokenType.LABEL:
-                            if is_indirect_label(op_value1):
-                                processed_tokens[0].value += 0x80
-                            elif is_half_label(op_value1):
-                                pass
-                            else:
-                                processed_tokens[0].value += 0x40
-
+                        elif is_half_label(op_value1):
+                            pass
                         else:
-                            print(f'{line_no}: Unknown mode based on operands')
-                            return
+                            processed_tokens[0].value += 0x40
 
-                        if op_type2 == TokenType.REGISTER:
-                            pass
-                        elif op_type2 == TokenType.ADDRESS:
-                            processed_tokens[0].value += 0x10
-                        elif op_type2 == TokenType.IMMEDIATE:
-                            processed_tokens[0].value += 0x20
-                        elif op_type2 == TokenType.INDIRECT:
+                    else:
+                        print(f'{line_no}: Unknown mode based on operands')
+                        return None
+
+                    if op_type2 == TokenType.REGISTER:
+                        pass
+                    elif op_type2 == TokenType.ADDRESS:
+                        processed_tokens[0].value += 0x10
+                    elif op_type2 == TokenType.IMMEDIATE:
+                        processed_tokens[0].value += 0x20
+                    elif op_type2 == TokenType.INDIRECT:
+                        processed_tokens[0].value += 0x30
+                    elif op_type2 == TokenType.LABEL:
+                        if is_indirect_label(op_value2):
                             processed_tokens[0].value += 0x30
-                        elif op_type2 == TokenType.LABEL:
-                            if is_indirect_label(op_value2):
-                                processed_tokens[0].value += 0x30
-                            elif is_half_label(op_value2):
-                                processed_tokens[0].value += 0x20
-                            else:
-                                processed_tokens[0].value += 0x10
+                        elif is_half_label(op_value2):
+                            processed_tokens[0].value += 0x20
                         else:
-                            print(f'{line_no}: Unknown mode based on operands')
-                            return
-                if processed_tokens[0].type == TokenType.DIRECTIVE and processed_tokens[0].value == Directive.EQU.value:
-                    continue
-                output.append((initial_pc, processed_tokens))
+                            processed_tokens[0].value += 0x10
+                    else:
+                        print(f'{line_no}: Unknown mode based on operands')
+                        return None
+            if processed_tokens[0].type == TokenType.DIRECTIVE and processed_tokens[0].value == Directive.EQU.value:
+                continue
+            if bank is not None and pc > bank_slot_start + BANK_SIZE:
+                print(f'{line_no}: bank {bank} is larger than {BANK_SIZE} bytes')
+                return None
+            if bank is not None and pc > initial_pc:
+                start, end = initial_pc - bank_slot_start, pc - bank_slot_start
+                ranges = bank_ranges.setdefault(bank, [])
+                for used_start, used_end, used_line in ranges:
+                    if start < used_end and used_start < end:
+                        print(f'{line_no}: overlaps bank {bank} bytes ${used_start:04X}-${used_end - 1:04X} placed from line {used_line}')
+                        return None
+                if ranges and ranges[-1][1] == start:
+                    ranges[-1] = (ranges[-1][0], end, ranges[-1][2])
+                else:
+                    ranges.append((start, end, line_no))
+            output.append((initial_pc, bank, processed_tokens))
 
-    file_output = []
-    
-    for line_no, (pc, line) in enumerate(output):
-        if args.verbose:
+    chunks = []
+
+    for line_no, (pc, bank, line) in enumerate(output):
+        if verbose:
             print(line)
-        mem_map = f'${pc:04X}:'
+        data = []
         for token in line:
             if token.type in [TokenType.DIRECTIVE, TokenType.LABEL_DEF]:
                 continue
@@ -351,7 +809,7 @@ def main():
                 label = label.strip('[]<>')
                 if label not in labels or labels[label] == -1:
                     print(f'{line_no}: label "{label}" not found!')
-                    return
+                    return None
                 else:
                     token.value = labels[label]
                     low, high = split_word_into_bytes(token.value)
@@ -368,26 +826,74 @@ def main():
                         token.type = TokenType.ADDRESS
 
             if token.type in [TokenType.ADDRESS, TokenType.INDIRECT]:
-                low, high = split_word_into_bytes(token.value)
-                mem_map += f' ${low:02X} ${high:02X}'
+                data += split_word_into_bytes(token.value)
             else:
-                mem_map += f' ${token.value:02X}'
+                data.append(token.value)
 
-        if len(mem_map) > 6:
-            file_output.append(f'{mem_map.replace("$", "")}\n')
-            if args.verbose:
-                print(mem_map)
+        if not data:
+            continue
 
-    
-    with open(args.out_file, 'w') as out_file:
-        for data in file_output:
-            out_file.write(data)
-
-        for rom in args.linked_roms:
-            if args.verbose:
-                print(f'Linking {rom}')
-            with open(rom, 'r') as linked_rom_file:
-                out_file.write(linked_rom_file.read())
+        if verbose:
+            bank_prefix = f'{bank:02X}:' if bank is not None else ''
+            print(f'{bank_prefix}${pc:04X}:' + ''.join(f' ${value:02X}' for value in data))
+
+        chunks.append((pc, bank, bytes(data)))
+
+    return chunks, labels
+
+def main():
+    parser = argparse.ArgumentParser(description='Assembler for a made-up instruction set')
+    parser.add_argument('source_file', metavar='source_file', type=str, help='ASM source file to assemble')
+    parser.add_argument('-v', '--verbose', dest='verbose', action='store_true')
+    parser.add_argument('-O', '--optimize', dest='optimize', action='store_true',
+                        help='Run the peephole and dead code optimizer and report what it saved')
+    parser.add_argument('-o', '--out', dest='out_file', metavar='output_file', default='default.rom')
+    parser.add_argument('-b', '--banks', dest='bank_file', metavar='bank_file', default=None,
+                        help='Binary file for code and data placed with .bank (default: output name + .banks)')
+    parser.add_argument('-l', '--link', dest='linked_roms', metavar='rom_file', type=str, nargs='+',
+                        help='Additional rom files to link')
+    parser.add_argument('-c', '--compress', dest='compress', action='store_true',
+                        help='Write a packed ROM with compressed sections instead of hex text')
+    args = parser.parse_args()
+
+    with open(args.source_file, 'r') as source:
+        lines = [(line_no, process_line(line.strip('\n'))) for line_no, line in enumerate(source)]
+
+    if args.optimize:
+        optimizer = PeepholeOptimizer(lines, args.verbose)
+        optimizer.run()
+        optimizer.print_report()
+
+    result = assemble(lines, args.verbose)
+    if result is None:
+        return
+    chunks, _ = result
+
+    file_output = []
+    bank_output = bytearray()
+    for pc, bank, data in chunks:
+        if bank is None:
+            file_output.append((pc, data))
+        else:
+            # offset within the bank is the same whichever slot the bank is shown in
+            offset = bank * BANK_SIZE + (pc - BANK_WINDOW_START) % BANK_SIZE
+            if len(bank_output) < (bank + 1) * BANK_SIZE:
+                bank_output.extend(bytes((bank + 1) * BANK_SIZE - len(bank_output)))
+            bank_output[offset:offset + len(data)] = data
+
+    for rom in args.linked_roms or []:
+        if args.verbose:
+            print(f'Linking {rom}')
+        file_output += read_rom(rom)
+
+    write_rom(args.out_file, file_output, args.compress)
+
+    if bank_output:
+        bank_file = args.bank_file or f'{os.path.splitext(args.out_file)[0]}.banks'
+        with open(bank_file, 'wb') as out_file:
+            out_file.write(bank_output)
+        if args.verbose:
+            print(f'Wrote {len(bank_output) // BANK_SIZE} banks to {bank_file}')
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,43 @@
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+from typing import List
+
+# Each fixture is a ROM, prog.rom, with prog.cmd holding the debug console
+# commands to run on it and prog.out the pc of every register dump the
+# console prints, one per line, starting with the one it opens with.
+
+def console_pcs(tangovm: str, rom: str, commands: str) -> List[str]:
+    result = subprocess.run([tangovm, '--headless', '--console', rom], input=commands,
+                            capture_output=True, text=True, timeout=30)
+    return re.findall(r'PC=(\$[0-9A-F]{4})', result.stdout)
+
+def main():
+    parser = argparse.ArgumentParser(description='Checks debug console sessions against fixtures')
+    parser.add_argument('fixtures', nargs='*', help='fixture ROMs (default: tests/debugger/*.rom)')
+    parser.add_argument('--tangovm', default='./tangovm', help='VM binary to run (default: ./tangovm)')
+    args = parser.parse_args()
+
+    fixtures = args.fixtures or sorted(glob.glob(os.path.join(os.path.dirname(__file__), '..', 'tests', 'debugger', '*.rom')))
+    failures = 0
+    for rom in fixtures:
+        name = os.path.basename(rom)
+        base = os.path.splitext(rom)[0]
+        with open(base + '.cmd') as commands, open(base + '.out') as expected_file:
+            actual = console_pcs(args.tangovm, rom, commands.read())
+            expected = expected_file.read().split()
+        if actual == expected:
+            print(f'{name}: ok')
+        else:
+            failures += 1
+            print(f'{name}: expected pcs {" ".join(expected)}')
+            print(f'{" " * len(name)}  got          {" ".join(actual)}')
+
+    print(f'{len(fixtures)} fixtures, {failures} failed')
+    sys.exit(1 if failures else 0)
+
+if __name__ == '__main__':
+    main()
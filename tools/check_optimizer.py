@@ -0,0 +1,79 @@
+import argparse
+import contextlib
+import glob
+import io
+import os
+import sys
+from typing import Dict, List, Optional, Tuple
+
+from assembler import PeepholeOptimizer, assemble, process_line
+from rom_format import read_rom
+
+# Each fixture is prog.asm next to prog.rom, the ROM `assembler.py -O` must
+# produce for it. The optimizer has to keep what every fixture does, so a
+# fixture records a shape it once got wrong along with the bytes it must emit.
+# The rest show each rewrite firing; their prog.report holds the -O report,
+# so the bytes and cycles it claims are checked too.
+
+def memory_of(chunks: List[Tuple[int, bytes]]) -> Dict[int, int]:
+    memory = {}
+    for pc, data in chunks:
+        for offset, value in enumerate(data):
+            memory[pc + offset] = value
+    return memory
+
+def optimize(source_file: str) -> Tuple[Dict[int, int], str]:
+    # the optimized memory and the report -O prints for it
+    with open(source_file, 'r') as source:
+        lines = [(line_no, process_line(line.strip('\n'))) for line_no, line in enumerate(source)]
+    optimizer = PeepholeOptimizer(lines, False)
+    optimizer.run()
+    report = io.StringIO()
+    with contextlib.redirect_stdout(report):
+        optimizer.print_report()
+    result = assemble(lines)
+    if result is None:
+        return {}, report.getvalue()
+    chunks, _ = result
+    return memory_of([(pc, data) for pc, bank, data in chunks if bank is None]), report.getvalue()
+
+def expected_report(source_file: str) -> Optional[str]:
+    report_file = os.path.splitext(source_file)[0] + '.report'
+    if not os.path.exists(report_file):
+        return None
+    with open(report_file, 'r') as report:
+        return report.read()
+
+def format_memory(memory: Dict[int, int]) -> str:
+    return ' '.join(f'{addr:04X}={value:02X}' for addr, value in sorted(memory.items()))
+
+def main():
+    parser = argparse.ArgumentParser(description='Checks the assembler optimizer against fixture ROMs')
+    parser.add_argument('fixtures', nargs='*', help='fixture sources (default: tests/optimizer/*.asm)')
+    args = parser.parse_args()
+
+    fixtures = args.fixtures or sorted(glob.glob(os.path.join(os.path.dirname(__file__), '..', 'tests', 'optimizer', '*.asm')))
+    failures = 0
+    for source_file in fixtures:
+        name = os.path.basename(source_file)
+        expected = memory_of(read_rom(os.path.splitext(source_file)[0] + '.rom'))
+        report = expected_report(source_file)
+        actual, actual_report = optimize(source_file)
+        if actual != expected:
+            failures += 1
+            print(f'{name}: expected {format_memory(expected)}')
+            print(f'{" " * len(name)}  got      {format_memory(actual)}')
+        elif report is not None and actual_report != report:
+            failures += 1
+            print(f'{name}: expected report')
+            print(report, end='')
+            print(f'{" " * len(name)}  got')
+            print(actual_report, end='')
+        else:
+            print(f'{name}: ok')
+
+    print(f'{len(fixtures)} fixtures, {failures} failed')
+    sys.exit(1 if failures else 0)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,619 @@
+from dataclasses import dataclass, field
+import sys
+from typing import Dict, List, Optional, Set, Tuple, Union
+from emit import Emitter
+from parse import *
+from tango import Call, Proc, Return, TangoProgram
+
+
+"""
+TangoVM assembly backend
+
+The syntax tree (Teeny Tiny BASIC, or a .tango program) is lowered to a
+small three-address IR over named values (program variables and expression
+temporaries), one routine at a time: main, then every proc it reaches.
+
+- constants are folded, including `const` globals, procs that only return a
+  constant, and variables that are only ever assigned one constant value;
+  they become immediates and never take a register
+- liveness is computed over the control flow graph (IF/WHILE/GOTO)
+- values are coloured onto r0-r6 with a Chaitin style allocator; values
+  that don't fit are spilled to zero page bytes and used directly as
+  memory operands. r7 is kept free as scratch. Globals have a zero page
+  byte of their own.
+- procs take their arguments and return their value on the data stack and
+  are called with jsr/ret. Around a call the caller saves the registers
+  that are live across it and that the callee (or anything it calls) uses.
+  Spilled values have one zero page byte per proc, so a proc that spills
+  can't be recursive.
+- `*` and `/` call runtime routines the same way; `*` by a power of two is
+  a chain of adds
+
+The VM is 8-bit, so every value is a byte and arithmetic wraps at 256.
+Comparisons are unsigned and `/` is integer division.
+"""
+
+ALLOCATABLE_REGISTERS = ["r0", "r1", "r2", "r3", "r4", "r5", "r6"]
+SCRATCH_REGISTER = "r7"
+SPILL_START = 0x0000    # spill slots grow up, the address stack grows down from $00FF
+RUNTIME_SCRATCH = 0x0080
+
+BRANCHES = {"==": "beq", "!=": "bne", "<": "blt", "<=": "ble", ">": "bgt", ">=": "bge"}
+NEGATED = {"==": "!=", "!=": "==", "<": ">=", ">=": "<", ">": "<=", "<=": ">"}
+MIRRORED = {"==": "==", "!=": "!=", "<": ">", ">": "<", "<=": ">=", ">=": "<="}
+
+Operand = Union[str, int]
+
+
+@dataclass
+class Instr:
+    op: str                         # mov, add, sub, mul, div, branch, jmp, label, print, end,
+                                    # pop (an argument), call, ret
+    dst: Optional[str] = None
+    srcs: List[Operand] = field(default_factory=list)
+    label: Optional[str] = None
+    cond: Optional[str] = None
+
+    def uses(self) -> Set[str]:
+        return {src for src in self.srcs if isinstance(src, str)}
+
+    def defs(self) -> Set[str]:
+        return {self.dst} if self.dst else set()
+
+
+@dataclass
+class Routine:
+    label: Optional[str]            # None for main
+    proc: Optional[Proc]
+    code: List[Instr]
+    locations: Dict[str, str]
+    live_out: List[Set[str]]
+    calls: Set[str]                 # labels of the procs it calls
+    writes: Set[str]                # registers it overwrites
+    spilled: bool
+
+
+def fold(op: str, left: int, right: int) -> int:
+    if op == "+":
+        return (left + right) & 0xFF
+    if op == "-":
+        return (left - right) & 0xFF
+    if op == "*":
+        return (left * right) & 0xFF
+    return left // right if right else 0
+
+
+def compare(op: str, left: int, right: int) -> bool:
+    return {
+        "==": left == right, "!=": left != right,
+        "<": left < right, "<=": left <= right,
+        ">": left > right, ">=": left >= right,
+    }[op]
+
+
+class AsmGenerator:
+    statements: List[Statement]
+    emitter: Emitter
+
+    def __init__(self, statements: List[Statement], emitter: Emitter, program: Optional[TangoProgram] = None):
+        self.statements = program.main if program else statements
+        self.emitter = emitter
+        self.program = program
+        self.code: List[Instr] = []
+        self.temp_count = 0
+        self.label_count = 0
+        self.runtime_used: Set[str] = set()
+
+        self.def_counts: Dict[str, int] = {}
+        self.constants: Dict[str, int] = {}
+        self.constant_procs: Dict[str, int] = {}
+        self.globals: Dict[str, str] = {}      # a zero page byte each, never in a register
+        self.next_spill = SPILL_START
+
+        self.routines: List[Routine] = []
+        self.pending: List[Proc] = []
+        self.queued: Set[str] = set()
+
+    def abort(self, message: str):
+        sys.exit("Error. " + message)
+
+    # --- constant variables -----------------------------
+
+    def count_definitions(self, block: List[Statement]):
+        for node in block:
+            if isinstance(node, (Let, Assign, Input)):
+                name = node.symbol.unique_name
+                self.def_counts[name] = self.def_counts.get(name, 0) + 1
+            elif isinstance(node, (If, While)):
+                self.count_definitions(node.body)
+
+    def find_constants(self, block: List[Statement]):
+        # variables given exactly one value, and that value is constant
+        for node in block:
+            if isinstance(node, Let):
+                unique = node.symbol.unique_name
+                value = self.constant_value(node.value)
+                if self.def_counts[unique] == 1 and value is not None:
+                    self.constants[unique] = value
+            elif isinstance(node, (If, While)):
+                self.find_constants(node.body)
+
+    def constant_value(self, node: Expr) -> Optional[int]:
+        if isinstance(node, Number):
+            return self.number(node)
+        if isinstance(node, Call):
+            return None if node.args else self.constant_procs.get(node.name)
+        if isinstance(node, Var):
+            return self.constants.get(node.symbol.unique_name)
+        if isinstance(node, Unary):
+            value = self.constant_value(node.operand)
+            if value is None:
+                return None
+            return (-value) & 0xFF if node.op == "-" else value
+        left = self.constant_value(node.left)
+        right = self.constant_value(node.right)
+        if left is None or right is None:
+            return None
+        return fold(node.op, left, right)
+
+    def number(self, node: Number) -> int:
+        if not node.text.isdigit() or int(node.text) > 0xFF:
+            self.abort(f"TangoVM target only supports whole numbers from 0 to 255, got {node.text}")
+        return int(node.text)
+
+    def find_constant_procs(self):
+        # procs that take nothing and only return a constant, e.g. get_A()
+        changed = True
+        while changed:
+            changed = False
+            for proc in self.program.procs.values():
+                if proc.name in self.constant_procs or proc.params or len(proc.body) != 1:
+                    continue
+                body = proc.body[0]
+                value = self.constant_value(body.value) if isinstance(body, Return) and body.value else None
+                if value is not None:
+                    self.constant_procs[proc.name] = value
+                    changed = True
+
+    def declare_globals(self):
+        for symbol, expr in self.program.constants:
+            value = self.constant_value(expr)
+            if value is None:
+                self.abort(f"const {symbol.name} is not a constant")
+            self.constants[symbol.unique_name] = value
+        for let in self.program.globals:
+            self.globals[let.symbol.unique_name] = f"${self.next_spill:04X}"
+            self.next_spill += 1
+        self.find_constant_procs()
+
+    # --- lowering ----------------------------------------------------------
+
+    def new_temp(self) -> str:
+        self.temp_count += 1
+        return f"%t{self.temp_count}"
+
+    def new_label(self, kind: str) -> str:
+        self.label_count += 1
+        return f"_{kind}_{self.label_count}"
+
+    def lower_expr(self, node: Expr) -> Operand:
+        value = self.constant_value(node)
+        if value is not None:
+            return value
+
+        if isinstance(node, Var):
+            return node.symbol.unique_name
+
+        if isinstance(node, Unary):
+            operand = self.lower_expr(node.operand)
+            if node.op == "+":
+                return operand
+            temp = self.new_temp()
+            self.code.append(Instr("sub", temp, [0, operand]))
+            return temp
+
+        if isinstance(node, Call):
+            temp = self.new_temp()
+            self.lower_call(node, temp)
+            return temp
+
+        left = self.lower_expr(node.left)
+        right = self.lower_expr(node.right)
+        if node.op == "*" and isinstance(left, int):
+            left, right = right, left
+        if node.op in ["*", "/"] and right == 1:
+            return left
+        if node.op == "*" and isinstance(right, int) and right & (right - 1) == 0:
+            # doubling with add beats a call to __mul8
+            if right == 0:
+                return 0
+            while right > 1:
+                temp = self.new_temp()
+                self.code.append(Instr("add", temp, [left, left]))
+                left, right = temp, right >> 1
+            return left
+
+        op = {"+": "add", "-": "sub", "*": "mul", "/": "div"}[node.op]
+        temp = self.new_temp()
+        self.code.append(Instr(op, temp, [left, right]))
+        return temp
+
+    def lower_call(self, node: Call, result: Optional[str]):
+        args = [self.lower_expr(arg) for arg in node.args]
+        label = f"p_{node.name}"
+        if label not in self.queued:
+            self.queued.add(label)
+            self.pending.append(node.proc)
+        self.code.append(Instr("call", result, args, label=label))
+
+    def lower_assignment(self, name: str, node: Expr):
+        if name in self.constants:
+            return
+        value = self.lower_expr(node)
+        last = self.code[-1] if self.code else None
+        if isinstance(value, str) and value.startswith("%") and last and last.dst == value:
+            # write the result straight into the variable
+            last.dst = name
+        else:
+            self.code.append(Instr("mov", name, [value]))
+
+    def lower_branch_if_false(self, condition: Comparison, label: str):
+        if len(condition.ops) != 1:
+            self.abort("TangoVM target only supports a single comparison per condition")
+
+        op = NEGATED[condition.ops[0]]
+        left = self.lower_expr(condition.operands[0])
+        right = self.lower_expr(condition.operands[1])
+
+        if isinstance(left, int) and isinstance(right, int):
+            if compare(op, left, right):
+                self.code.append(Instr("jmp", label=label))
+            return
+        if isinstance(left, int):
+            # cmp needs a register on the left
+            left, right, op = right, left, MIRRORED[op]
+        self.code.append(Instr("branch", srcs=[left, right], label=label, cond=op))
+
+    def lower_block(self, block: List[Statement]):
+        for node in block:
+            if isinstance(node, Let) or isinstance(node, Assign):
+                self.lower_assignment(node.symbol.unique_name, node.value)
+            elif isinstance(node, Print):
+                if isinstance(node.value, str):
+                    self.abort("TangoVM target can't print strings")
+                self.code.append(Instr("print", srcs=[self.lower_expr(node.value)]))
+            elif isinstance(node, Input):
+                self.abort("TangoVM target has no INPUT")
+            elif isinstance(node, Call):
+                # a value nobody reads still comes off the data stack
+                self.lower_call(node, self.new_temp() if node.proc.returns_value else None)
+            elif isinstance(node, Return):
+                self.code.append(Instr("ret", srcs=[self.lower_expr(node.value)] if node.value else []))
+            elif isinstance(node, Label):
+                self.code.append(Instr("label", label=f"l_{node.name}"))
+            elif isinstance(node, Goto):
+                self.code.append(Instr("jmp", label=f"l_{node.name}"))
+            elif isinstance(node, If):
+                end = self.new_label("endif")
+                self.lower_branch_if_false(node.condition, end)
+                self.lower_block(node.body)
+                self.code.append(Instr("label", label=end))
+            elif isinstance(node, While):
+                top = self.new_label("while")
+                end = self.new_label("endwhile")
+                self.code.append(Instr("label", label=top))
+                self.lower_branch_if_false(node.condition, end)
+                self.lower_block(node.body)
+                self.code.append(Instr("jmp", label=top))
+                self.code.append(Instr("label", label=end))
+
+    # --- register allocation -----------------------------------------------
+
+    def successors(self, index: int, labels: Dict[str, int]) -> List[int]:
+        instr = self.code[index]
+        if instr.op in ["end", "ret"]:
+            return []
+        if instr.op == "jmp":
+            return [labels[instr.label]]
+        following = [index + 1] if index + 1 < len(self.code) else []
+        if instr.op == "branch":
+            return following + [labels[instr.label]]
+        return following
+
+    def liveness(self) -> List[Set[str]]:
+        labels = {instr.label: i for i, instr in enumerate(self.code) if instr.op == "label"}
+        live_in = [set() for _ in self.code]
+        live_out = [set() for _ in self.code]
+
+        changed = True
+        while changed:
+            changed = False
+            for index in reversed(range(len(self.code))):
+                instr = self.code[index]
+                out = set()
+                for successor in self.successors(index, labels):
+                    out |= live_in[successor]
+                new_in = instr.uses() | (out - instr.defs())
+                if out != live_out[index] or new_in != live_in[index]:
+                    live_out[index] = out
+                    live_in[index] = new_in
+                    changed = True
+        return live_out
+
+    def allocate(self) -> Tuple[Dict[str, str], List[Set[str]]]:
+        live_out = self.liveness()
+        fixed = set(self.globals)
+
+        values: Set[str] = set()
+        uses: Dict[str, int] = {}
+        for instr in self.code:
+            values |= (instr.uses() | instr.defs()) - fixed
+            for value in (instr.uses() | instr.defs()) - fixed:
+                uses[value] = uses.get(value, 0) + 1
+
+        interference: Dict[str, Set[str]] = {value: set() for value in values}
+        moves: Dict[str, Set[str]] = {value: set() for value in values}
+        for instr, out in zip(self.code, live_out):
+            for dst in instr.defs() - fixed:
+                # a mov's source and destination may share a register
+                exclude = instr.uses() if instr.op == "mov" else set()
+                for other in out - exclude - fixed - {dst}:
+                    interference[dst].add(other)
+                    interference[other].add(dst)
+            if instr.op == "sub" and instr.dst not in fixed:
+                # sub writes its left operand first, so the right one needs a register of its own
+                right = instr.srcs[1]
+                if isinstance(right, str) and right not in fixed and right not in [instr.dst, instr.srcs[0]]:
+                    interference[instr.dst].add(right)
+                    interference[right].add(instr.dst)
+            if instr.op == "mov" and instr.uses() - fixed and instr.dst not in fixed:
+                src = next(iter(instr.uses()))
+                moves[instr.dst].add(src)
+                moves[src].add(instr.dst)
+
+        # simplify: repeatedly remove a value with fewer neighbours than
+        # registers, or failing that the cheapest value to spill
+        k = len(ALLOCATABLE_REGISTERS)
+        remaining = set(values)
+        stack: List[str] = []
+        while remaining:
+            degree = {v: len(interference[v] & remaining) for v in remaining}
+            easy = [v for v in remaining if degree[v] < k]
+            if easy:
+                chosen = min(easy, key=lambda v: (degree[v], v))
+            else:
+                chosen = min(remaining, key=lambda v: (uses[v] / (degree[v] + 1), v))
+            stack.append(chosen)
+            remaining.remove(chosen)
+
+        locations: Dict[str, str] = {}
+        spill_address = self.next_spill
+        while stack:
+            value = stack.pop()
+            taken = {locations[n] for n in interference[value] if n in locations}
+            free = [r for r in ALLOCATABLE_REGISTERS if r not in taken]
+            preferred = [locations[m] for m in moves[value] if m in locations and locations[m] in free]
+            if preferred:
+                locations[value] = preferred[0]
+            elif free:
+                locations[value] = free[0]
+            else:
+                locations[value] = f"${spill_address:04X}"
+                spill_address += 1
+
+        if spill_address >= RUNTIME_SCRATCH:
+            self.abort("Too many variables for zero page")
+        self.next_spill = spill_address
+        return locations, live_out
+
+    # --- emission ----------------------------------------------------------
+
+    def location(self, operand: Operand) -> str:
+        if isinstance(operand, int):
+            return f"#{operand}"
+        if operand in self.globals:
+            return self.globals[operand]
+        return self.locations[operand]
+
+    @staticmethod
+    def is_register(location: str) -> bool:
+        return location.startswith("r")
+
+    def emit(self, line: str):
+        self.emitter.emit_line(f"    {line}")
+
+    def emit_mov(self, dst: str, src: str):
+        if dst != src:
+            self.emit(f"mov {dst}, {src}")
+
+    def emit_arithmetic(self, instr: Instr):
+        dst = self.location(instr.dst)
+        left, right = (self.location(src) for src in instr.srcs)
+        op = instr.op
+
+        if op in ["mul", "div"]:
+            self.runtime_used.add(op)
+            self.emit(f"psh {left}")
+            self.emit(f"psh {right}")
+            self.emit(f"jsr __{op}8")
+            self.emit(f"pop {dst}")
+            return
+
+        if op == "add" and right == dst and left != dst:
+            left, right = right, left
+
+        target = dst
+        if not self.is_register(dst) or (right == dst and left != dst):
+            target = SCRATCH_REGISTER
+        self.emit_mov(target, left)
+
+        if right == "#1":
+            self.emit(f"{'inc' if op == 'add' else 'dec'} {target}")
+        elif right != "#0":
+            self.emit(f"{op} {target}, {right}")
+        self.emit_mov(dst, target)
+
+    def is_discarded(self, index: int, instr: Instr) -> bool:
+        # an argument or call result nobody reads is popped into scratch
+        return instr.op in ["pop", "call"] and instr.dst is not None and instr.dst not in self.live_out[index]
+
+    def emit_call(self, index: int, instr: Instr):
+        # registers live across the call that the callee may overwrite
+        saved = sorted({self.location(value) for value in self.live_out[index] - instr.defs()}
+                       & self.clobbers[instr.label])
+        for register in saved:
+            self.emit(f"psh {register}")
+        for arg in instr.srcs:
+            self.emit(f"psh {self.location(arg)}")
+        self.emit(f"jsr {instr.label}")
+        if instr.dst:
+            self.emit(f"pop {SCRATCH_REGISTER if self.is_discarded(index, instr) else self.location(instr.dst)}")
+        for register in reversed(saved):
+            self.emit(f"pop {register}")
+
+    def emit_instr(self, index: int, instr: Instr):
+        if instr.op == "label":
+            self.emitter.emit_line(f"{instr.label}:")
+        elif instr.op == "jmp":
+            self.emit(f"jmp {instr.label}")
+        elif instr.op == "end":
+            self.emit("end")
+        elif instr.op == "mov":
+            self.emit_mov(self.location(instr.dst), self.location(instr.srcs[0]))
+        elif instr.op == "print":
+            # dbg shows every register, the comment says which one holds the value
+            location = self.location(instr.srcs[0])
+            if self.is_register(location):
+                self.emit(f"dbg ; {location}")
+            else:
+                self.emit_mov(SCRATCH_REGISTER, location)
+                self.emit(f"dbg ; {SCRATCH_REGISTER}")
+        elif instr.op == "pop":
+            self.emit(f"pop {SCRATCH_REGISTER if self.is_discarded(index, instr) else self.location(instr.dst)}")
+        elif instr.op == "call":
+            self.emit_call(index, instr)
+        elif instr.op == "ret":
+            if instr.srcs:
+                self.emit(f"psh {self.location(instr.srcs[0])}")
+            self.emit("ret")
+        elif instr.op == "branch":
+            left, right = (self.location(src) for src in instr.srcs)
+            if not self.is_register(left):
+                self.emit_mov(SCRATCH_REGISTER, left)
+                left = SCRATCH_REGISTER
+            self.emit(f"cmp {left}, {right}")
+            self.emit(f"{BRANCHES[instr.cond]} {instr.label}")
+        else:
+            self.emit_arithmetic(instr)
+
+    def emit_runtime(self):
+        a = f"${RUNTIME_SCRATCH:04X}"
+        b = f"${RUNTIME_SCRATCH + 1:04X}"
+        # ( a b -- a*b ) and ( a b -- a/b ), r6 is saved, r7 is scratch
+        if "mul" in self.runtime_used:
+            self.emitter.emit_line("__mul8:")
+            for line in [f"pop {b}", f"pop {a}", "psh r6", f"mov r6, {b}", "mov r7, #0"]:
+                self.emit(line)
+            self.emitter.emit_line("__mul8_loop:")
+            for line in ["cmp r6, #0", "beq __mul8_done", f"add r7, {a}", "dec r6", "jmp __mul8_loop"]:
+                self.emit(line)
+            self.emitter.emit_line("__mul8_done:")
+            for line in ["pop r6", "psh r7", "ret"]:
+                self.emit(line)
+        if "div" in self.runtime_used:
+            self.emitter.emit_line("__div8:")
+            # dividing by zero gives zero
+            for line in [f"pop {b}", f"pop {a}", "psh r6", "mov r7, #0", f"mov r6, {b}",
+                         "cmp r6, #0", "beq __div8_done", f"mov r6, {a}"]:
+                self.emit(line)
+            self.emitter.emit_line("__div8_loop:")
+            for line in [f"cmp r6, {b}", "blt __div8_done", f"sub r6, {b}", "inc r7", "jmp __div8_loop"]:
+                self.emit(line)
+            self.emitter.emit_line("__div8_done:")
+            for line in ["pop r6", "psh r7", "ret"]:
+                self.emit(line)
+
+    def compile_routine(self, proc: Optional[Proc], body: List[Statement]):
+        self.code = []
+        self.count_definitions(body)
+        self.find_constants(body)
+        if proc:
+            # the last argument was pushed last
+            for param in reversed(proc.params):
+                self.code.append(Instr("pop", param.unique_name))
+        elif self.program:
+            for let in self.program.globals:
+                self.lower_assignment(let.symbol.unique_name, let.value)
+        self.lower_block(body)
+        if not proc:
+            self.code.append(Instr("end"))
+        elif not self.code or self.code[-1].op != "ret":
+            # falling off the end returns 0
+            self.code.append(Instr("ret", srcs=[0] if proc.returns_value else []))
+
+        spill_start = self.next_spill
+        self.locations, self.live_out = self.allocate()
+        calls = {instr.label for instr in self.code if instr.op == "call"}
+        writes = {self.location(dst) for index, instr in enumerate(self.code) for dst in instr.defs()
+                  if not self.is_discarded(index, instr)}
+        self.routines.append(Routine(f"p_{proc.name}" if proc else None, proc, self.code, self.locations,
+                                     self.live_out, calls, {w for w in writes if self.is_register(w)},
+                                     self.next_spill != spill_start))
+
+    def find_clobbers(self):
+        # registers each proc may overwrite, including through the procs it calls
+        self.clobbers: Dict[str, Set[str]] = {}
+        for routine in self.routines:
+            self.clobbers[routine.label] = set(routine.writes)
+        changed = True
+        while changed:
+            changed = False
+            for routine in self.routines:
+                for callee in routine.calls:
+                    if not self.clobbers[callee] <= self.clobbers[routine.label]:
+                        self.clobbers[routine.label] |= self.clobbers[callee]
+                        changed = True
+
+    def check_recursion(self):
+        by_label = {routine.label: routine for routine in self.routines}
+        for routine in self.routines:
+            if not routine.spilled:
+                continue
+            seen: Set[str] = set()
+            stack = list(routine.calls)
+            while stack:
+                label = stack.pop()
+                if label == routine.label:
+                    self.abort(f"proc {routine.proc.name} is recursive and has too many values for registers")
+                if label not in seen:
+                    seen.add(label)
+                    stack.extend(by_label[label].calls)
+
+    def generate(self):
+        if self.program:
+            self.declare_globals()
+        self.compile_routine(None, self.statements)
+        while self.pending:
+            proc = self.pending.pop(0)
+            self.compile_routine(proc, proc.body)
+        self.find_clobbers()
+        self.check_recursion()
+
+        self.emitter.header_line("; generated by teenyc")
+        for value, location in sorted(self.globals.items()):
+            self.emitter.header_line(f"; {value} -> {location}")
+        for routine in self.routines:
+            for value, location in sorted(routine.locations.items()):
+                if not value.startswith("%"):
+                    self.emitter.header_line(f"; {value} -> {location}")
+        for value, constant in sorted(self.constants.items()):
+            self.emitter.header_line(f"; {value} = #{constant}")
+        self.emitter.header_line("    .org $200")
+
+        for routine in self.routines:
+            self.code, self.locations, self.live_out = routine.code, routine.locations, routine.live_out
+            if routine.label:
+                self.emitter.emit_line(f"{routine.label}:")
+            for index, instr in enumerate(self.code):
+                self.emit_instr(index, instr)
+        self.emit_runtime()
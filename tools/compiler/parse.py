@@ -1,6 +1,6 @@
 from dataclasses import dataclass
 import sys
-from typing import List, Set, Union
+from typing import Dict, List, Optional, Set, Union
 from emit import Emitter
 from lex import *
 
@@ -13,12 +13,105 @@ Every time we encounter an if/while statement, push a new scope on to the list
 All new variables are added to tail scope
 Check variables in current scope, then check parent scope
 Pop scope when exiting if/while block
+
+Type inference
+
+Each symbol is an int64_t until something wider is stored in it. Number
+literals with a decimal point, `/` and INPUT produce doubles, and a
+symbol that is ever given a double is a double everywhere. Every value
+prints as a double and `/` divides as doubles, so no value needs a runtime
+type tag. Integers are 64-bit and the C is compiled with -fwrapv, so one
+that overflows (e.g. `A = A * A` in a loop) wraps around where a double
+would have lost precision instead; that is the one place the inferred
+type shows.
+Declarations are emitted after the whole program is parsed, once the
+types have settled.
 """
 
+INT = "int64_t"
+DOUBLE = "double"
+
+@dataclass
+class Symbol:
+    name: str
+    unique_name: str    # distinguishes shadowed variables for backends without block scope
+    type: str = INT
+
+# Syntax tree, built alongside the C output so other backends can walk it.
+
+@dataclass
+class Number:
+    text: str
+
+@dataclass
+class Var:
+    name: str
+    symbol: Optional[Symbol] = None
+
+@dataclass
+class Unary:
+    op: str
+    operand: "Expr"
+
+@dataclass
+class Binary:
+    op: str
+    left: "Expr"
+    right: "Expr"
+
+Expr = Union[Number, Var, Unary, Binary]
+
+@dataclass
+class Comparison:
+    ops: List[str]
+    operands: List[Expr]
+
+@dataclass
+class Print:
+    value: Union[str, Expr]
+    newline: bool
+
+@dataclass
+class If:
+    condition: Comparison
+    body: List["Statement"]
+
+@dataclass
+class While:
+    condition: Comparison
+    body: List["Statement"]
+
+@dataclass
+class Label:
+    name: str
+
+@dataclass
+class Goto:
+    name: str
+
+@dataclass
+class Let:
+    name: str
+    value: Expr
+    symbol: Optional[Symbol] = None
+
+@dataclass
+class Input:
+    name: str
+    symbol: Optional[Symbol] = None
+
+@dataclass
+class Assign:
+    name: str
+    value: Expr
+    symbol: Optional[Symbol] = None
+
+Statement = Union[Print, If, While, Label, Goto, Let, Input, Assign]
+
 @dataclass
 class Scope:
     code_index: int
-    symbols: Set[str]
+    symbols: Dict[str, Symbol]
     labels_declared: Set[str]
     labels_gotoed: Set[str]
 
@@ -36,12 +129,18 @@ class Parser:
     peek_token: Token
     scopes: List[Scope]
     scope_index: int
+    closed_scopes: List[Scope]
+    symbol_counts: Dict[str, int]
+    statements: List[Statement]
 
     def __init__(self, lexer: Lexer, emitter: Emitter):
         self.lexer = lexer
         self.emitter = emitter
         self.scopes = []
         self.scope_index = -1
+        self.closed_scopes = []
+        self.symbol_counts = {}
+        self.statements = []
 
         self.current_token = None
         self.peek_token = None
@@ -49,14 +148,13 @@ class Parser:
         self.next_token()
 
     def push_scope(self):
-        self.scopes.append(Scope(len(self.emitter.code), set(), set(), set()))
+        self.scopes.append(Scope(len(self.emitter.code), {}, set(), set()))
         self.scope_index += 1
 
     def pop_scope(self):
         if len(self.scopes) > 1:
-            scope = self.scopes.pop()
+            self.closed_scopes.append(self.scopes.pop())
             self.scope_index -= 1
-            self.emit_symobls(scope)
         else:
             self.abort("Tried to pop global scope!")
 
@@ -65,10 +163,63 @@ class Parser:
             if identifier in getattr(scope, property.value):
                 return True
         return False
-    
-    def emit_symobls(self, scope: Scope):
-        for symbol in scope.symbols:
-            self.emitter.emit_line_at(f"TinyVar {symbol};", scope.code_index)
+
+    def find_symbol(self, identifier: str) -> Symbol:
+        for scope in reversed(self.scopes):
+            if identifier in scope.symbols:
+                return scope.symbols[identifier]
+        self.abort(f'Referencing variable before declaration: {identifier}')
+
+    def declare_symbol(self, identifier: str) -> Symbol:
+        if identifier in self.current_scope.symbols:
+            self.abort(f"Variable {identifier} already declared!")
+        count = self.symbol_counts.get(identifier, 0) + 1
+        self.symbol_counts[identifier] = count
+        symbol = Symbol(identifier, identifier if count == 1 else f"{identifier}.{count}")
+        self.current_scope.symbols[identifier] = symbol
+        return symbol
+
+    def expression_type(self, node: Expr) -> str:
+        if isinstance(node, Number):
+            return DOUBLE if "." in node.text else INT
+        if isinstance(node, Var):
+            return node.symbol.type
+        if isinstance(node, Unary):
+            return self.expression_type(node.operand)
+        if node.op == "/":
+            return DOUBLE
+        if DOUBLE in [self.expression_type(node.left), self.expression_type(node.right)]:
+            return DOUBLE
+        return INT
+
+    def infer_types(self):
+        # types only ever widen, so this settles within a pass per symbol
+        changed = True
+        while changed:
+            changed = False
+
+            def visit(block: List[Statement]):
+                nonlocal changed
+                for node in block:
+                    if isinstance(node, (Let, Assign)):
+                        value_type = self.expression_type(node.value)
+                    elif isinstance(node, Input):
+                        value_type = DOUBLE
+                    else:
+                        if isinstance(node, (If, While)):
+                            visit(node.body)
+                        continue
+                    if value_type == DOUBLE and node.symbol.type != DOUBLE:
+                        node.symbol.type = DOUBLE
+                        changed = True
+
+            visit(self.statements)
+
+    def emit_symbols(self):
+        # insert from the end so earlier scope indexes stay valid
+        for scope in sorted(self.closed_scopes, key=lambda scope: scope.code_index, reverse=True):
+            for symbol in scope.symbols.values():
+                self.emitter.emit_line_at(f"{symbol.type} {symbol.name};", scope.code_index)
 
     @property
     def current_scope(self) -> Scope:
@@ -102,7 +253,7 @@ class Parser:
 
     def program(self):
         self.emitter.header_line("#include <stdio.h>")
-        self.emitter.header_line('#include "src/tinyvars.c"')
+        self.emitter.header_line("#include <stdint.h>")
         self.emitter.header_line("int main() {")
         self.push_scope() # global scope
 
@@ -110,32 +261,37 @@ class Parser:
             self.next_token()
 
         while not self.check_token(TokenType.EOF):
-            self.statement()
+            self.statements.append(self.statement())
 
         self.emitter.emit_line("return 0;")
         self.emitter.emit_line("}")
-        self.emit_symobls(self.scopes[0])
+        self.closed_scopes.append(self.scopes[0])
+        self.infer_types()
+        self.emit_symbols()
 
         for label in self.current_scope.labels_gotoed:
             if label not in self.current_scope.labels_declared:
                 self.abort(f"Attempting to GOTO undeclared label: {label}")
 
-    def statement(self):
+    def statement(self) -> Statement:
+        node = None
         if self.check_multiple_tokens([TokenType.PRINT, TokenType.PRINTLN]):
-            nl = r'\n' if self.check_token(TokenType.PRINTLN) else ''
+            newline = self.check_token(TokenType.PRINTLN)
+            nl = r'\n' if newline else ''
             self.next_token()
 
             if self.check_token(TokenType.STRING):
                 self.emitter.emit_line(rf'printf("{self.current_token.text}{nl}");')
+                node = Print(self.current_token.text, newline)
                 self.next_token()
             else:
-                self.emitter.emit(rf'printf("%.2f{nl}", (float)(')
-                self.expression()
+                self.emitter.emit(rf'printf("%.2f{nl}", (double)(')
+                node = Print(self.expression(), newline)
                 self.emitter.emit_line(r'));')
         elif self.check_token(TokenType.IF):
             self.next_token()
             self.emitter.emit("if(")
-            self.comparison()
+            node = If(self.comparison(), [])
 
             self.match(TokenType.THEN)
             self.newline()
@@ -143,7 +299,7 @@ class Parser:
             self.push_scope()
 
             while not self.check_token(TokenType.ENDIF):
-                self.statement()
+                node.body.append(self.statement())
 
             self.match(TokenType.ENDIF)
             self.emitter.emit_line("}")
@@ -151,14 +307,14 @@ class Parser:
         elif self.check_token(TokenType.WHILE):
             self.next_token()
             self.emitter.emit("while(")
-            self.comparison()
+            node = While(self.comparison(), [])
 
             self.match(TokenType.REPEAT)
             self.newline()
             self.emitter.emit_line("){")
 
             while not self.check_token(TokenType.ENDWHILE):
-                self.statement()
+                node.body.append(self.statement())
 
             self.match(TokenType.ENDWHILE)
             self.emitter.emit_line("}")
@@ -170,68 +326,70 @@ class Parser:
             self.current_scope.labels_declared.add(self.current_token.text)
 
             self.emitter.emit_line(f"{self.current_token.text}:")
+            node = Label(self.current_token.text)
             self.match(TokenType.IDENT)
         elif self.check_token(TokenType.GOTO):
             self.next_token()
             self.current_scope.labels_gotoed.add(self.current_token.text)
             self.emitter.emit_line(rf"goto {self.current_token.text};")
+            node = Goto(self.current_token.text)
             self.match(TokenType.IDENT)
         elif self.check_token(TokenType.LET):
             self.next_token()
 
-            if self.current_token.text not in self.current_scope.symbols:
-                self.current_scope.symbols.add(self.current_token.text)
-            else:
-                self.abort(f"Variable {self.current_token.text} already declared!")
-
-            self.emitter.emit_line(rf'{self.current_token.text}.type = TINY_VAR_FLOAT;')
-            self.emitter.emit(rf'{self.current_token.text}.f64 = ')
+            name = self.current_token.text
+            symbol = self.declare_symbol(name)
+            self.emitter.emit(rf'{name} = ')
             self.match(TokenType.IDENT)
             self.match(TokenType.EQ)
-            self.expression()
+            node = Let(name, self.expression(), symbol)
             self.emitter.emit_line(";")
         elif self.check_token(TokenType.INPUT):
             self.next_token()
 
-            if not self.check_all_scopes_for_identifier(self.current_token.text, ScopeProperty.SYMBOLS):
-                self.abort(f'Referencing variable before declaration: {self.current_token.text}')
+            symbol = self.find_symbol(self.current_token.text)
 
-            self.emitter.emit_line(rf'if (0 == scanf("%f", &{self.current_token.text})) {{')
+            self.emitter.emit_line(rf'if (0 == scanf("%lf", &{self.current_token.text})) {{')
             self.emitter.emit_line(rf'{self.current_token.text} = 0;')
             self.emitter.emit(r'scanf("%')
             self.emitter.emit_line(r'*s");')
             self.emitter.emit_line(r'}')
+            node = Input(self.current_token.text, symbol)
             self.match(TokenType.IDENT)
         elif self.check_token(TokenType.IDENT):
-            if not self.check_all_scopes_for_identifier(self.current_token.text, ScopeProperty.SYMBOLS):
-                self.abort(f'Referencing variable before declaration: {self.current_token.text}')
-            
+            symbol = self.find_symbol(self.current_token.text)
+
             self.emitter.emit(rf'{self.current_token.text} = ')
+            name = self.current_token.text
             self.next_token()
             self.match(TokenType.EQ)
-            self.expression()
+            node = Assign(name, self.expression(), symbol)
             self.emitter.emit_line(";")
 
         self.newline()
+        return node
 
     def newline(self):
         self.match(TokenType.NEWLINE)
         while self.check_token(TokenType.NEWLINE):
             self.next_token()
 
-    def comparison(self):
-        self.expression()
+    def comparison(self) -> Comparison:
+        node = Comparison([], [self.expression()])
         if self.is_comparison_operator():
             self.emitter.emit(self.current_token.text);
+            node.ops.append(self.current_token.text)
             self.next_token()
-            self.expression()
+            node.operands.append(self.expression())
         else:
             self.abort(f"Expected comparison operator at: {self.current_token.text}")
     
         while self.is_comparison_operator():
             self.emitter.emit(self.current_token.text);
+            node.ops.append(self.current_token.text)
             self.next_token()
-            self.expression()
+            node.operands.append(self.expression())
+        return node
 
     def is_comparison_operator(self):
         return self.check_multiple_tokens([
@@ -243,34 +401,45 @@ class Parser:
             TokenType.NOTEQ,
         ])
 
-    def expression(self):
-        self.term()
+    def expression(self) -> Expr:
+        node = self.term()
         while self.check_multiple_tokens([TokenType.PLUS, TokenType.MINUS]):
             self.emitter.emit(self.current_token.text);
+            op = self.current_token.text
             self.next_token()
-            self.term()
+            node = Binary(op, node, self.term())
+        return node
     
-    def term(self):
-        self.unary()
+    def term(self) -> Expr:
+        node = self.unary()
         while self.check_multiple_tokens([TokenType.ASTERISK, TokenType.SLASH]):
             self.emitter.emit(self.current_token.text);
+            if self.check_token(TokenType.SLASH):
+                self.emitter.emit("(double)")
+            op = self.current_token.text
             self.next_token()
-            self.unary()
+            node = Binary(op, node, self.unary())
+        return node
 
-    def unary(self):
+    def unary(self) -> Expr:
+        op = None
         if self.check_multiple_tokens([TokenType.PLUS, TokenType.MINUS]):
             self.emitter.emit(self.current_token.text);
+            op = self.current_token.text
             self.next_token()
-        self.primary()
+        node = self.primary()
+        return Unary(op, node) if op else node
 
-    def primary(self):
+    def primary(self) -> Expr:
         if self.check_token(TokenType.NUMBER):
             self.emitter.emit(self.current_token.text);
+            node = Number(self.current_token.text)
             self.next_token()
         elif self.check_token(TokenType.IDENT):
-            if not self.check_all_scopes_for_identifier(self.current_token.text, ScopeProperty.SYMBOLS):
-                self.abort(f'Referencing variable before declaration: {self.current_token.text}')
-            self.emitter.emit(f"{self.current_token.text}.f64");
+            symbol = self.find_symbol(self.current_token.text)
+            self.emitter.emit(self.current_token.text);
+            node = Var(self.current_token.text, symbol)
             self.next_token()
         else:
             self.abort(f"Unexpected token at {self.current_token.text}")
+        return node
@@ -0,0 +1,373 @@
+from dataclasses import dataclass, field
+import re
+import sys
+from typing import Dict, List, Optional, Tuple
+from parse import Assign, Binary, Comparison, Expr, If, Let, Number, Print, Statement, Symbol, Unary, Var, While
+
+
+"""
+Tango front end, for the TangoVM assembly target
+
+A .tango program is an optional `globals` block, any number of procs and a
+`main` block. Every value is a byte. Expressions are prefix: `(+ n get_A())`
+adds n and what get_A returns, `(- x)` negates x.
+
+    globals {
+        const byte A = 10;      # folded into every use, takes no memory
+        var byte n = 0;         # lives in zero page, shared by every proc
+    }
+
+    proc byte twice(byte a) {
+        return (+ a a);
+    }
+
+    main {
+        var byte i = 0;
+        while (< i 5) {
+            n = (+ n twice(i));
+            i = (+ i 1);
+        }
+        print n;
+    }
+
+Statements are `var byte x = e;`, `x = e;`, `name(args);`, `return [e];`,
+`print e;` and `if`/`while` with a comparison, `(== a b)`, `(< a b)` and so
+on, followed by a block. `#` starts a comment. A call's `(` follows the
+name directly, so `(+ a (- b))` is an operand and not a call of a. Procs
+may be called before they are defined. The tree reuses the Teeny Tiny BASIC nodes from parse.py,
+so asmgen.py lowers both languages the same way.
+"""
+
+
+@dataclass
+class Call:
+    name: str
+    args: List[Expr]
+    proc: Optional["Proc"] = None
+    line: int = 0
+
+@dataclass
+class Return:
+    value: Optional[Expr]
+
+@dataclass
+class Proc:
+    name: str
+    returns_value: bool
+    params: List[Symbol]
+    body: List[Statement] = field(default_factory=list)
+
+@dataclass
+class TangoProgram:
+    constants: List[Tuple[Symbol, Expr]]    # in order, so a const can use earlier ones
+    globals: List[Let]
+    procs: Dict[str, Proc]
+    main: List[Statement]
+
+
+KEYWORDS = {"globals", "const", "var", "proc", "main", "return", "if", "while", "print", "byte", "void"}
+OPERATORS = ["==", "!=", "<=", ">=", "<", ">", "+", "-", "*", "/"]
+COMPARISONS = ["==", "!=", "<", "<=", ">", ">="]
+TOKEN = re.compile(r"(\d+)|([A-Za-z_]\w*)|(==|!=|<=|>=|[-+*/<>(){},;=])")
+SPACE = re.compile(r"\s+|#[^\n]*")
+
+
+@dataclass
+class TangoToken:
+    text: str
+    kind: str       # number, ident, keyword, symbol or eof
+    line: int
+    spaced: bool    # whitespace or a comment came before it
+
+
+def tokenize(source: str) -> List[TangoToken]:
+    tokens = []
+    pos = 0
+    line = 1
+    while True:
+        # skip whitespace and comments, which may span several lines
+        start = pos
+        while True:
+            match = SPACE.match(source, pos)
+            if not match or match.end() == pos:
+                break
+            line += match.group(0).count("\n")
+            pos = match.end()
+        if pos >= len(source):
+            break
+        match = TOKEN.match(source, pos)
+        if not match:
+            sys.exit(f"Error. Line {line}: unexpected character {source[pos]!r}")
+        number, word, symbol = match.groups()
+        spaced = pos != start
+        if number is not None:
+            tokens.append(TangoToken(number, "number", line, spaced))
+        elif word is not None:
+            tokens.append(TangoToken(word, "keyword" if word in KEYWORDS else "ident", line, spaced))
+        else:
+            tokens.append(TangoToken(symbol, "symbol", line, spaced))
+        pos = match.end()
+    tokens.append(TangoToken("", "eof", line, True))
+    return tokens
+
+
+class TangoParser:
+    tokens: List[TangoToken]
+    position: int
+    scopes: List[Dict[str, Symbol]]
+    symbol_counts: Dict[str, int]
+    calls: List[Call]
+    value_calls: List[Call]     # calls whose result is used
+
+    def __init__(self, source: str):
+        self.tokens = tokenize(source)
+        self.position = 0
+        self.scopes = [{}]
+        self.symbol_counts = {}
+        self.calls = []
+        self.value_calls = []
+        self.constant_names = set()
+        self.program = TangoProgram([], [], {}, [])
+        self.proc: Optional[Proc] = None
+
+    @property
+    def current(self) -> TangoToken:
+        return self.tokens[self.position]
+
+    def abort(self, message: str):
+        sys.exit(f"Error. Line {self.current.line}: {message}")
+
+    def check(self, text: str) -> bool:
+        return self.current.kind in ["keyword", "symbol"] and self.current.text == text
+
+    def match(self, text: str):
+        if not self.check(text):
+            self.abort(f"Expected {text}, got {self.current.text or 'end of file'}")
+        self.position += 1
+
+    def match_ident(self) -> str:
+        if self.current.kind != "ident":
+            self.abort(f"Expected a name, got {self.current.text or 'end of file'}")
+        self.position += 1
+        return self.tokens[self.position - 1].text
+
+    def at_call(self) -> bool:
+        following = self.tokens[self.position + 1]
+        return self.current.kind == "ident" and following.text == "(" and not following.spaced
+
+    def match_type(self) -> bool:
+        # True for byte, False for void
+        if self.check("byte"):
+            self.position += 1
+            return True
+        if self.check("void"):
+            self.position += 1
+            return False
+        self.abort(f"Expected byte or void, got {self.current.text}")
+
+    # --- symbols -----------------------------------------------------------
+
+    def declare(self, name: str) -> Symbol:
+        if name in self.scopes[-1]:
+            self.abort(f"{name} already declared")
+        # locals are named after their proc, so they never clash with a global
+        base = f"{self.proc.name}.{name}" if self.proc else name
+        if self.proc is None and len(self.scopes) > 1:
+            base = f"main.{name}"
+        count = self.symbol_counts.get(base, 0) + 1
+        self.symbol_counts[base] = count
+        symbol = Symbol(name, base if count == 1 else f"{base}.{count}")
+        self.scopes[-1][name] = symbol
+        return symbol
+
+    def find(self, name: str) -> Symbol:
+        for scope in reversed(self.scopes):
+            if name in scope:
+                return scope[name]
+        self.abort(f"Referencing variable before declaration: {name}")
+
+    # --- program structure -------------------------------------------------
+
+    def parse(self) -> TangoProgram:
+        if self.check("globals"):
+            self.position += 1
+            self.match("{")
+            while not self.check("}"):
+                self.global_declaration()
+            self.match("}")
+
+        while self.check("proc"):
+            self.proc_definition()
+
+        self.match("main")
+        self.program.main = self.block()
+        if self.current.kind != "eof":
+            self.abort(f"Unexpected {self.current.text} after main")
+
+        for call in self.calls:
+            call.proc = self.program.procs.get(call.name)
+            if call.proc is None:
+                sys.exit(f"Error. Line {call.line}: calling undefined proc {call.name}")
+            if len(call.args) != len(call.proc.params):
+                sys.exit(f"Error. Line {call.line}: {call.name} takes {len(call.proc.params)} arguments, "
+                         f"got {len(call.args)}")
+        for call in self.value_calls:
+            if not call.proc.returns_value:
+                sys.exit(f"Error. Line {call.line}: void proc {call.name} has no value")
+        return self.program
+
+    def global_declaration(self):
+        constant = self.check("const")
+        if not constant and not self.check("var"):
+            self.abort(f"Expected const or var, got {self.current.text}")
+        self.position += 1
+        if not self.match_type():
+            self.abort("Variables can't be void")
+        symbol = self.declare(self.match_ident())
+        self.match("=")
+        value = self.expression()
+        self.match(";")
+        if constant:
+            self.constant_names.add(symbol.unique_name)
+            self.program.constants.append((symbol, value))
+        else:
+            self.program.globals.append(Let(symbol.name, value, symbol))
+
+    def proc_definition(self):
+        self.match("proc")
+        returns_value = self.match_type()
+        name = self.match_ident()
+        if name in self.program.procs:
+            self.abort(f"proc {name} already defined")
+
+        self.proc = Proc(name, returns_value, [])
+        self.program.procs[name] = self.proc
+        self.scopes.append({})
+        self.match("(")
+        while not self.check(")"):
+            if self.proc.params:
+                self.match(",")
+            if not self.match_type():
+                self.abort("Arguments can't be void")
+            self.proc.params.append(self.declare(self.match_ident()))
+        self.match(")")
+        self.proc.body = self.block(new_scope=False)
+        self.scopes.pop()
+        self.proc = None
+
+    def block(self, new_scope: bool = True) -> List[Statement]:
+        self.match("{")
+        if new_scope:
+            self.scopes.append({})
+        body = []
+        while not self.check("}"):
+            body.append(self.statement())
+        self.match("}")
+        if new_scope:
+            self.scopes.pop()
+        return body
+
+    # --- statements --------------------------------------------------------
+
+    def statement(self) -> Statement:
+        if self.check("var"):
+            self.position += 1
+            if not self.match_type():
+                self.abort("Variables can't be void")
+            name = self.match_ident()
+            self.match("=")
+            # the value is parsed before the name is in scope, as in C
+            value = self.expression()
+            self.match(";")
+            symbol = self.declare(name)
+            return Let(name, value, symbol)
+
+        if self.check("return"):
+            if self.proc is None:
+                self.abort("return outside a proc")
+            self.position += 1
+            value = None if self.check(";") else self.expression()
+            if (value is None) == self.proc.returns_value:
+                self.abort(f"proc {self.proc.name} must return {'a byte' if self.proc.returns_value else 'nothing'}")
+            self.match(";")
+            return Return(value)
+
+        if self.check("print"):
+            self.position += 1
+            value = self.expression()
+            self.match(";")
+            return Print(value, True)
+
+        if self.check("if") or self.check("while"):
+            kind = If if self.current.text == "if" else While
+            self.position += 1
+            condition = self.comparison()
+            return kind(condition, self.block())
+
+        if self.at_call():
+            call = self.call()
+            self.match(";")
+            return call
+
+        name = self.match_ident()
+        symbol = self.find(name)
+        if symbol.unique_name in self.constant_names:
+            self.abort(f"Can't assign to const {name}")
+        self.match("=")
+        value = self.expression()
+        self.match(";")
+        return Assign(name, value, symbol)
+
+    def comparison(self) -> Comparison:
+        self.match("(")
+        op = self.current.text
+        if op not in COMPARISONS:
+            self.abort(f"Expected a comparison, got {op}")
+        self.position += 1
+        left = self.expression()
+        right = self.expression()
+        self.match(")")
+        return Comparison([op], [left, right])
+
+    # --- expressions -------------------------------------------------------
+
+    def call(self) -> Call:
+        line = self.current.line
+        name = self.match_ident()
+        self.match("(")
+        args = []
+        while not self.check(")"):
+            if args:
+                self.match(",")
+            args.append(self.expression())
+        self.match(")")
+        call = Call(name, args, line=line)
+        self.calls.append(call)
+        return call
+
+    def expression(self) -> Expr:
+        token = self.current
+        if token.kind == "number":
+            self.position += 1
+            return Number(token.text)
+
+        if token.kind == "ident":
+            if self.at_call():
+                call = self.call()
+                self.value_calls.append(call)
+                return call
+            self.position += 1
+            return Var(token.text, self.find(token.text))
+
+        self.match("(")
+        op = self.current.text
+        if op not in OPERATORS or op in COMPARISONS:
+            self.abort(f"Expected + - * or /, got {op}")
+        self.position += 1
+        left = self.expression()
+        if op == "-" and self.check(")"):
+            self.position += 1
+            return Unary("-", left)
+        node = Binary(op, left, self.expression())
+        self.match(")")
+        return node
@@ -1,32 +1,59 @@
 from lex import *
 from emit import *
 from parse import *
+from asmgen import AsmGenerator
+from tango import TangoParser
+import argparse
 import sys
 import subprocess
 
 def main():
     print("Teeny Tiny Compiler")
 
-    if len(sys.argv) != 2:
-        sys.exit("Error: Compiler needs source file as argument.")
-    with open(sys.argv[1], 'r') as input_file:
+    arg_parser = argparse.ArgumentParser(description='Compile Teeny Tiny BASIC or .tango programs')
+    arg_parser.add_argument('source', help='source file, .tango files are Tango and the rest Teeny Tiny BASIC')
+    arg_parser.add_argument('-t', '--target', choices=['c', 'asm'],
+                            help='c builds a native binary with gcc, asm writes TangoVM assembly '
+                                 '(default: asm for .tango, c otherwise)')
+    arg_parser.add_argument('-o', '--output', help='assembly file to write (default: source name with .asm)')
+    args = arg_parser.parse_args()
+
+    with open(args.source, 'r') as input_file:
         input = input_file.read()
 
+    binary_name = args.source.split(".")[0]
+    asm_filename = args.output or binary_name + ".asm"
+
+    if args.source.endswith(".tango"):
+        if args.target == 'c':
+            sys.exit("Error. .tango programs only compile to TangoVM assembly")
+        program = TangoParser(input).parse()
+        asm_emitter = Emitter(asm_filename)
+        AsmGenerator(program.main, asm_emitter, program).generate()
+        asm_emitter.write_file()
+        return
+
     lexer = Lexer(input)
     emitter = Emitter("out.c")
     parser = Parser(lexer, emitter)
 
     parser.program()
-    emitter.write_file()
 
-    binary_name = sys.argv[1].split(".")[0]
+    if args.target == 'asm':
+        asm_emitter = Emitter(asm_filename)
+        AsmGenerator(parser.statements, asm_emitter).generate()
+        asm_emitter.write_file()
+        return
+
+    emitter.write_file()
 
     subprocess.run(["clang-format", "-i", "out.c"])
-    result = subprocess.run(["gcc", "out.c", "-o", binary_name, "-Os"])
+    # integer overflow wraps instead of being undefined
+    result = subprocess.run(["gcc", "out.c", "-o", binary_name, "-Os", "-fwrapv"])
     if result.returncode != 0:
         print("Could not compile code")
         sys.exit(1)
 
 
 if __name__ == '__main__':
-    main()
\ No newline at end of file
+    main()
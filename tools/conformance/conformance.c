@@ -0,0 +1,649 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "ref_cpu.h"
+#include "../../src/vm_cpu.h"
+#include "../../src/vm_rom.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Differential conformance runner. The candidate engine is whatever is
+// linked in through vm_cpu.h (normally vm_cpu.c, with superinstructions and
+// lazy flags); the reference is ref_cpu.c. Both run the same program and
+// after every candidate step the reference catches up to the same cycle
+// count, which lines a fused pair up with the two instructions it replaces.
+// Registers, flags, pc, stack pointers, halting, memory writes and cycles
+// must then all agree. Random programs that diverge are shrunk to a minimal
+// reproducer.
+
+#define CODE_START 0x0200
+#define DATA_START 0x0400
+#define DATA_END 0x0500
+#define STACKS_END 0x0200           // address stack page, then data stack page
+#define MAX_PROGRAM 48
+#define RANDOM_STEPS 2000           // random programs loop, so cap them
+#define FULL_COMPARE_INTERVAL 4096  // steps between whole memory compares on long runs
+
+typedef struct {
+    uint8_t bytes[5];
+    uint8_t length;
+    int16_t target;     // instruction a jump, branch or call goes to, -1 for none
+} program_instruction_t;
+
+// A random program: code placed from CODE_START and the initial contents
+// of the stack pages and the data page. Targets are instruction indices so
+// instructions can be dropped while shrinking.
+typedef struct {
+    program_instruction_t code[MAX_PROGRAM];
+    int count;
+    uint8_t stacks[STACKS_END];
+    uint8_t data[DATA_END - DATA_START];
+} program_t;
+
+typedef struct {
+    uint32_t step;
+    uint16_t pc;
+    char what[160];
+} divergence_t;
+
+static ref_vm_t ref;
+static uint8_t image[MAX_MEMORY];
+static FILE* report;
+
+// ---- candidate memory map: flat RAM with every write logged ----
+
+static uint16_t write_addrs[REF_MAX_WRITES];
+static uint8_t write_values[REF_MAX_WRITES];
+static int write_count;
+
+uint8_t system_read_byte(uint16_t addr) {
+    return READ_PAGED(addr);
+}
+
+uint16_t system_read_word(uint16_t addr) {
+    return COMBINE_TO_WORD(system_read_byte(addr), system_read_byte(addr + 1));
+}
+
+void system_write_byte(uint16_t addr, uint8_t value) {
+    vm.memory[addr] = value;
+    if (write_count < REF_MAX_WRITES) {
+        write_addrs[write_count] = addr;
+        write_values[write_count] = value;
+    }
+    write_count++;
+}
+
+// ---- running both engines ----
+
+static void reset_engines(const uint8_t* memory) {
+    memset(&vm, 0, sizeof(vm));
+    init_cpu();
+    memcpy(vm.memory, memory, MAX_MEMORY);
+    vm.running = true;
+
+    ref_init(&ref);
+    memcpy(ref.memory, memory, MAX_MEMORY);
+}
+
+static bool compare_state(divergence_t* divergence, uint64_t ref_total, uint64_t candidate_total) {
+    char* what = divergence->what;
+    size_t size = sizeof(divergence->what);
+
+    if (ref_total != candidate_total) {
+        snprintf(what, size, "cycles: reference %llu, candidate %llu",
+            (unsigned long long)ref_total, (unsigned long long)candidate_total);
+        return false;
+    }
+    if (ref.pc != vm.pc) {
+        snprintf(what, size, "pc: reference $%04X, candidate $%04X", ref.pc, vm.pc);
+        return false;
+    }
+    for (int i = 0; i < R_COUNT; i++) {
+        if (ref.registers[i] != vm.registers[i]) {
+            snprintf(what, size, "r%d: reference $%02X, candidate $%02X", i, ref.registers[i], vm.registers[i]);
+            return false;
+        }
+    }
+    if (ref.status != current_status()) {
+        snprintf(what, size, "status: reference $%02X, candidate $%02X", ref.status, current_status());
+        return false;
+    }
+    if (ref.as != vm.as || ref.ds != vm.ds) {
+        snprintf(what, size, "as/ds: reference $%02X/$%02X, candidate $%02X/$%02X", ref.as, ref.ds, vm.as, vm.ds);
+        return false;
+    }
+    if (ref.x != vm.x || ref.y != vm.y) {
+        snprintf(what, size, "x/y: reference $%04X/$%04X, candidate $%04X/$%04X", ref.x, ref.y, vm.x, vm.y);
+        return false;
+    }
+    if (ref.running != vm.running) {
+        snprintf(what, size, "running: reference %d, candidate %d", ref.running, vm.running);
+        return false;
+    }
+    if (ref.write_count != write_count) {
+        snprintf(what, size, "memory writes: reference %d, candidate %d", ref.write_count, write_count);
+        return false;
+    }
+    for (int i = 0; i < write_count && i < REF_MAX_WRITES; i++) {
+        if (ref.write_addrs[i] != write_addrs[i] || ref.write_values[i] != write_values[i]) {
+            snprintf(what, size, "write %d: reference $%04X=$%02X, candidate $%04X=$%02X",
+                i, ref.write_addrs[i], ref.write_values[i], write_addrs[i], write_values[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool compare_memory(divergence_t* divergence) {
+    for (uint32_t addr = 0; addr < MAX_MEMORY; addr++) {
+        if (ref.memory[addr] != vm.memory[addr]) {
+            snprintf(divergence->what, sizeof(divergence->what), "memory $%04X: reference $%02X, candidate $%02X",
+                addr, ref.memory[addr], vm.memory[addr]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs both engines from memory until they halt or max_steps candidate
+// steps have run. Returns false and fills divergence at the first difference.
+static bool run_lockstep(const uint8_t* memory, uint32_t max_steps, divergence_t* divergence) {
+    reset_engines(memory);
+    uint64_t ref_total = 0;
+    uint64_t candidate_total = 0;
+
+    for (uint32_t step = 0; step < max_steps && vm.running; step++) {
+        divergence->step = step;
+        divergence->pc = vm.pc;
+
+        write_count = 0;
+        ref.write_count = 0;
+        vm.cycle = 0;
+        cpu_cycle();
+        candidate_total += vm.cycle;
+
+        while (ref.running && ref_total < candidate_total) {
+            ref_step(&ref);
+            ref_total += ref.cycle;
+        }
+
+        if (!compare_state(divergence, ref_total, candidate_total)) {
+            return false;
+        }
+        if (step % FULL_COMPARE_INTERVAL == FULL_COMPARE_INTERVAL - 1 && !compare_memory(divergence)) {
+            return false;
+        }
+    }
+    return compare_memory(divergence);
+}
+
+// ---- random programs ----
+
+static uint64_t rng_state;
+
+static uint32_t next_random() {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static uint32_t random_below(uint32_t n) {
+    return next_random() % n;
+}
+
+static uint8_t random_register() {
+    static const uint8_t special[] = { R_ST, R_AS, R_DS, R_XL, R_XH, R_YL, R_YH, R_X, R_Y, 0x0F, 0xF2 };
+    if (random_below(3)) {
+        return (uint8_t)random_below(R_COUNT);
+    }
+    return special[random_below(sizeof(special))];
+}
+
+static uint16_t random_address() {
+    switch (random_below(8)) {
+        case 0: return (uint16_t)random_below(STACKS_END);
+        case 1: return (uint16_t)(CODE_START + random_below(0x100));   // self-modifying code
+        case 2: return (uint16_t)random_below(0x10000);
+        default: return (uint16_t)(DATA_START + random_below(DATA_END - DATA_START));
+    }
+}
+
+static uint8_t random_immediate() {
+    return random_below(4) ? (uint8_t)random_below(0x100) : (uint8_t)random_below(3);
+}
+
+static void put_word(program_instruction_t* instruction, uint16_t word) {
+    instruction->bytes[instruction->length++] = LO_BYTE(word);
+    instruction->bytes[instruction->length++] = HI_BYTE(word);
+}
+
+// operand for mov and the math ops, by mode % 4
+static void put_source(program_instruction_t* instruction, uint8_t mode) {
+    switch (mode % 4) {
+        case 0: instruction->bytes[instruction->length++] = random_register(); break;
+        case 1: put_word(instruction, random_address()); break;
+        case 2: instruction->bytes[instruction->length++] = random_immediate(); break;
+        case 3: put_word(instruction, (uint16_t)(DATA_START + random_below(0x100))); break;
+    }
+}
+
+static program_instruction_t make_instruction(uint8_t opcode) {
+    program_instruction_t instruction = { .bytes = { opcode }, .length = 1, .target = -1 };
+    return instruction;
+}
+
+static program_instruction_t random_instruction(int count) {
+    static const uint8_t simple[] = { 0x00, 0x40, 0x50, 0x80, 0xFE, 0xFF };
+    static const uint8_t branches[] = { 0x01, 0x11, 0x21, 0x31, 0x41, 0x51, 0x10, 0x70 };
+    static const uint8_t math_ops[] = { 3, 4, 5, 7 };
+    static const uint8_t pops[] = { 0x48, 0x58, 0x78 };
+    program_instruction_t instruction;
+
+    switch (random_below(10)) {
+        case 0:
+        case 1: {
+            uint8_t mode = (uint8_t)random_below(0xC);
+            instruction = make_instruction((uint8_t)(mode << 4 | 2));
+            if (mode < 4) {
+                instruction.bytes[instruction.length++] = random_register();
+            } else if (mode < 8) {
+                put_word(&instruction, random_address());
+            } else {
+                put_word(&instruction, (uint16_t)(DATA_START + random_below(0x100)));
+            }
+            put_source(&instruction, mode);
+            return instruction;
+        }
+        case 2:
+        case 3: {
+            uint8_t mode = (uint8_t)random_below(8);
+            instruction = make_instruction((uint8_t)(mode << 4 | math_ops[random_below(4)]));
+            instruction.bytes[instruction.length++] = random_register();
+            put_source(&instruction, mode);
+            return instruction;
+        }
+        case 4:
+            if (random_below(2)) {
+                uint8_t mode = (uint8_t)random_below(4);
+                instruction = make_instruction((uint8_t)(mode << 4 | 8));
+                put_source(&instruction, mode);
+            } else {
+                instruction = make_instruction(pops[random_below(3)]);
+                if (instruction.bytes[0] == 0x48) {
+                    instruction.bytes[instruction.length++] = random_register();
+                } else {
+                    put_word(&instruction, random_address());
+                }
+            }
+            return instruction;
+        case 5: {
+            static const uint8_t unary[] = { 0x20, 0x30, 0x60 };
+            instruction = make_instruction(unary[random_below(3)]);
+            instruction.bytes[instruction.length++] = random_register();
+            return instruction;
+        }
+        case 6:
+            instruction = make_instruction(simple[random_below(sizeof(simple))]);
+            return instruction;
+        case 7:
+        case 8:
+            instruction = make_instruction(branches[random_below(sizeof(branches))]);
+            instruction.length = 3;
+            instruction.target = (int16_t)random_below(count + 1);
+            return instruction;
+        default:
+            // anything at all, bad opcodes and bad modes included
+            instruction = make_instruction((uint8_t)random_below(0x100));
+            instruction.length = 3;
+            instruction.bytes[1] = random_register();
+            instruction.bytes[2] = random_immediate();
+            return instruction;
+    }
+}
+
+// Pairs the candidate fuses: cmp reg, #imm with beq/bne, dec reg with bne,
+// inc xl with adc xh, #0, and jsr to a ret.
+static int random_fusible_pair(program_t* program, int index) {
+    program_instruction_t* first = &program->code[index];
+    program_instruction_t* second = &program->code[index + 1];
+    uint8_t reg = random_register();
+
+    switch (random_below(4)) {
+        case 0:
+            *first = make_instruction(0x25);
+            first->bytes[first->length++] = reg;
+            first->bytes[first->length++] = random_immediate();
+            *second = make_instruction(random_below(2) ? 0x01 : 0x11);
+            break;
+        case 1:
+            *first = make_instruction(0x30);
+            first->bytes[first->length++] = reg;
+            *second = make_instruction(0x11);
+            break;
+        case 2:
+            *first = make_instruction(0x20);
+            first->bytes[first->length++] = R_XL;
+            *second = make_instruction(0x63);
+            second->bytes[second->length++] = R_XH;
+            second->bytes[second->length++] = 0x00;
+            return 2;
+        default:
+            *first = make_instruction(0x70);
+            first->length = 3;
+            first->target = (int16_t)(index + 1);
+            *second = make_instruction(0x80);
+            return 2;
+    }
+    second->length = 3;
+    second->target = (int16_t)random_below(program->count + 1);
+    return 2;
+}
+
+static void random_program(program_t* program, uint64_t seed) {
+    rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    memset(program, 0, sizeof(*program));
+    program->count = 4 + (int)random_below(MAX_PROGRAM - 4);
+
+    for (int i = 0; i < program->count; ) {
+        if (i + 1 < program->count && random_below(4) == 0) {
+            i += random_fusible_pair(program, i);
+        } else {
+            program->code[i] = random_instruction(program->count);
+            i++;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(program->stacks); i++) {
+        program->stacks[i] = (uint8_t)random_below(0x100);
+    }
+    for (size_t i = 0; i < sizeof(program->data); i++) {
+        program->data[i] = (uint8_t)random_below(0x100);
+    }
+}
+
+// Places the program in memory, followed by an end, with targets resolved.
+static void layout_program(const program_t* program, uint8_t* memory) {
+    uint16_t addrs[MAX_PROGRAM + 1];
+    uint16_t addr = CODE_START;
+    for (int i = 0; i < program->count; i++) {
+        addrs[i] = addr;
+        addr += program->code[i].length;
+    }
+    addrs[program->count] = addr;
+
+    memset(memory, 0, MAX_MEMORY);
+    memcpy(memory, program->stacks, sizeof(program->stacks));
+    memcpy(memory + DATA_START, program->data, sizeof(program->data));
+    for (int i = 0; i < program->count; i++) {
+        const program_instruction_t* instruction = &program->code[i];
+        memcpy(memory + addrs[i], instruction->bytes, instruction->length);
+        if (instruction->target >= 0) {
+            memory[addrs[i] + 1] = LO_BYTE(addrs[instruction->target]);
+            memory[addrs[i] + 2] = HI_BYTE(addrs[instruction->target]);
+        }
+    }
+    memory[addrs[program->count]] = 0xFF;
+}
+
+static bool program_conforms(const program_t* program, divergence_t* divergence) {
+    layout_program(program, image);
+    return run_lockstep(image, RANDOM_STEPS, divergence);
+}
+
+static program_t remove_instructions(const program_t* program, int start, int count) {
+    program_t result = *program;
+    result.count = 0;
+    for (int i = 0; i < program->count; i++) {
+        if (i >= start && i < start + count) {
+            continue;
+        }
+        program_instruction_t instruction = program->code[i];
+        if (instruction.target >= start + count) {
+            instruction.target -= count;
+        } else if (instruction.target >= start) {
+            instruction.target = start;
+        }
+        result.code[result.count++] = instruction;
+    }
+    return result;
+}
+
+static void clear_bytes(program_t* program, uint8_t* bytes, size_t size, divergence_t* divergence) {
+    for (size_t chunk = size; chunk >= 1; chunk /= 2) {
+        for (size_t start = 0; start < size; start += chunk) {
+            size_t length = start + chunk <= size ? chunk : size - start;
+            uint8_t saved[DATA_END - DATA_START + STACKS_END];
+            memcpy(saved, bytes + start, length);
+            memset(bytes + start, 0, length);
+            if (program_conforms(program, divergence)) {
+                memcpy(bytes + start, saved, length);
+            }
+        }
+    }
+}
+
+// Drops runs of instructions, halving the run length down to single
+// instructions, then zeroes as much of the initial memory as it can, keeping
+// every change after which the program still diverges.
+static void shrink_program(program_t* program) {
+    divergence_t divergence;
+    for (int chunk = program->count / 2; chunk >= 1; chunk /= 2) {
+        for (int start = 0; start + chunk <= program->count; ) {
+            program_t smaller = remove_instructions(program, start, chunk);
+            if (!program_conforms(&smaller, &divergence)) {
+                *program = smaller;
+            } else {
+                start += chunk;
+            }
+        }
+    }
+    clear_bytes(program, program->stacks, sizeof(program->stacks), &divergence);
+    clear_bytes(program, program->data, sizeof(program->data), &divergence);
+}
+
+// writes the program as a hex text ROM that tangovm and the debugger load
+static void write_program_rom(const program_t* program, const char* filename) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        fprintf(report, "Could not open %s\n", filename);
+        return;
+    }
+
+    layout_program(program, image);
+    for (uint32_t addr = 0; addr < DATA_END; addr += 16) {
+        bool used = false;
+        for (uint32_t i = 0; i < 16; i++) {
+            used = used || image[addr + i];
+        }
+        if (!used) {
+            continue;
+        }
+        fprintf(file, "%04X:", addr);
+        for (uint32_t i = 0; i < 16; i++) {
+            fprintf(file, " %02X", image[addr + i]);
+        }
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
+static void print_program(const program_t* program) {
+    layout_program(program, image);
+    uint16_t addr = CODE_START;
+    for (int i = 0; i < program->count; i++) {
+        fprintf(report, "  $%04X:", addr);
+        for (int b = 0; b < program->code[i].length; b++) {
+            fprintf(report, " %02X", image[addr + b]);
+        }
+        fprintf(report, "\n");
+        addr += program->code[i].length;
+    }
+    fprintf(report, "  $%04X: FF\n", addr);
+
+    int nonzero = 0;
+    for (uint32_t i = 0; i < DATA_END; i++) {
+        if ((i < CODE_START || i >= DATA_START) && image[i]) {
+            if (nonzero++ < 16) {
+                fprintf(report, "  [$%04X] = $%02X\n", i, image[i]);
+            }
+        }
+    }
+    if (nonzero > 16) {
+        fprintf(report, "  ... %d more non-zero bytes of initial memory\n", nonzero - 16);
+    }
+}
+
+// ---- timing ----
+
+static double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+typedef struct {
+    double ref_seconds;
+    double candidate_seconds;
+    uint64_t cycles;
+} timing_t;
+
+// each engine on its own, for the same number of cycles
+static void time_engines(const uint8_t* memory, uint32_t max_steps, timing_t* timing) {
+    reset_engines(memory);
+    uint64_t cycles = 0;
+    double start = seconds_now();
+    for (uint32_t step = 0; step < max_steps && vm.running; step++) {
+        vm.cycle = 0;
+        cpu_cycle();
+        cycles += vm.cycle;
+    }
+    timing->candidate_seconds += seconds_now() - start;
+
+    uint64_t ref_cycles = 0;
+    start = seconds_now();
+    while (ref.running && ref_cycles < cycles) {
+        ref_step(&ref);
+        ref_cycles += ref.cycle;
+    }
+    timing->ref_seconds += seconds_now() - start;
+    timing->cycles += cycles;
+}
+
+static void print_timing(const char* name, const timing_t* timing) {
+    fprintf(report, "%s: %llu cycles, reference %.1f Mcycles/s, candidate %.1f Mcycles/s (%.2fx)\n",
+        name, (unsigned long long)timing->cycles,
+        timing->cycles / timing->ref_seconds / 1e6, timing->cycles / timing->candidate_seconds / 1e6,
+        timing->ref_seconds / timing->candidate_seconds);
+}
+
+// ---- entry point ----
+
+static void print_usage(const char* program) {
+    printf("Usage: %s [options] [rom_file...]\n", program);
+    puts("  -n N        random programs to run (default 20000)");
+    puts("  -s SEED     seed of the first random program (default 1)");
+    puts("  -c N        most instructions to run per ROM (default 1000000)");
+    puts("  -o FILE     write the shrunk reproducer of the first divergence as a ROM");
+}
+
+int main(int argc, char** argv) {
+    uint32_t program_count = 20000;
+    uint64_t first_seed = 1;
+    uint32_t rom_steps = 1000000;
+    const char* repro_filename = NULL;
+    int rom_start = argc;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "-n") == 0 && has_value) {
+            program_count = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-s") == 0 && has_value) {
+            first_seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-c") == 0 && has_value) {
+            rom_steps = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-o") == 0 && has_value) {
+            repro_filename = argv[++i];
+        } else if (argv[i][0] == '-') {
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            rom_start = i;
+            break;
+        }
+    }
+
+    // the engines print on bad opcodes and dbg, keep that out of the report
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report || !freopen("/dev/null", "w", stdout)) {
+        return 1;
+    }
+
+    int failures = 0;
+    divergence_t divergence;
+    timing_t timing = { 0 };
+
+    for (uint32_t i = 0; i < program_count; i++) {
+        program_t program;
+        uint64_t seed = first_seed + i;
+        random_program(&program, seed);
+        if (program_conforms(&program, &divergence)) {
+            time_engines(image, RANDOM_STEPS, &timing);
+            continue;
+        }
+
+        if (failures++ == 0) {
+            int original_count = program.count;
+            shrink_program(&program);
+            program_conforms(&program, &divergence);
+            fprintf(report, "seed %llu: after step %u at $%04X, %s\n",
+                (unsigned long long)seed, divergence.step, divergence.pc, divergence.what);
+            fprintf(report, "shrunk from %d to %d instructions:\n", original_count, program.count);
+            print_program(&program);
+            if (repro_filename) {
+                write_program_rom(&program, repro_filename);
+                fprintf(report, "reproducer written to %s\n", repro_filename);
+            }
+        } else if (failures <= 10) {
+            fprintf(report, "seed %llu: after step %u at $%04X, %s\n",
+                (unsigned long long)seed, divergence.step, divergence.pc, divergence.what);
+        }
+    }
+    fprintf(report, "%u random programs, %d diverged\n", program_count, failures);
+    if (timing.cycles) {
+        print_timing("random programs", &timing);
+    }
+
+    for (int i = rom_start; i < argc; i++) {
+        uint8_t* memory = calloc(1, MAX_MEMORY);
+        if (!memory) {
+            return 1;
+        }
+        if (!load_rom(argv[i], memory)) {
+            fprintf(report, "%s: could not load\n", argv[i]);
+            failures++;
+            free(memory);
+            continue;
+        }
+
+        if (run_lockstep(memory, rom_steps, &divergence)) {
+            timing_t rom_timing = { 0 };
+            time_engines(memory, rom_steps, &rom_timing);
+            fprintf(report, "%s: %u steps conform\n", argv[i], divergence.step + 1);
+            print_timing(argv[i], &rom_timing);
+        } else {
+            failures++;
+            fprintf(report, "%s: after step %u at $%04X, %s\n", argv[i], divergence.step, divergence.pc, divergence.what);
+        }
+        free(memory);
+    }
+
+    fclose(report);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,324 @@
+#include "ref_cpu.h"
+
+#include <string.h>
+
+// The reference interpreter the conformance runner holds vm_cpu.c to. It
+// does the one obvious thing for every instruction: flags are written as
+// soon as they change, nothing is fused and memory is flat. Quirks of the
+// instruction set are reproduced on purpose (ALU ops on x/y do nothing,
+// cmp on xh/yh compares against value << 8, a math op with a bad mode still
+// runs its ALU step). Keep it plain; speed belongs in vm_cpu.c.
+
+static void store(ref_vm_t* ref, uint16_t addr, uint8_t value) {
+    ref->memory[addr] = value;
+    if (ref->write_count < REF_MAX_WRITES) {
+        ref->write_addrs[ref->write_count] = addr;
+        ref->write_values[ref->write_count] = value;
+    }
+    ref->write_count++;
+}
+
+static uint8_t read_mem(ref_vm_t* ref, uint16_t addr) {
+    ref->cycle++;
+    return ref->memory[addr];
+}
+
+static uint16_t read_mem_word(ref_vm_t* ref, uint16_t addr) {
+    ref->cycle += 2;
+    uint8_t low = ref->memory[addr];
+    uint8_t high = ref->memory[(uint16_t)(addr + 1)];
+    return COMBINE_TO_WORD(low, high);
+}
+
+static void write_mem(ref_vm_t* ref, uint16_t addr, uint8_t value) {
+    ref->cycle++;
+    store(ref, addr, value);
+}
+
+static uint8_t fetch(ref_vm_t* ref) {
+    ref->cycle++;
+    return ref->memory[ref->pc++];
+}
+
+static uint16_t fetch_word(ref_vm_t* ref) {
+    uint8_t low = fetch(ref);
+    uint8_t high = fetch(ref);
+    return COMBINE_TO_WORD(low, high);
+}
+
+static void bad_instruction(ref_vm_t* ref) {
+    ref->running = false;
+}
+
+static void set_flags(ref_vm_t* ref, uint16_t result) {
+    uint8_t flags = 0;
+    if ((result & 0xFF) == 0) flags |= FLAG_ZERO;
+    if (result & 0x80) flags |= FLAG_NEG;
+    if (result > 0xFF) flags |= FLAG_CARRY;
+    ref->status = (ref->status & ~(FLAG_ZERO | FLAG_NEG | FLAG_CARRY)) | flags;
+}
+
+static bool flag(ref_vm_t* ref, uint8_t mask) {
+    return (ref->status & mask) == mask;
+}
+
+static bool is_word_reg(uint8_t reg) {
+    return reg == R_X || reg == R_Y;
+}
+
+static uint8_t get_reg(ref_vm_t* ref, uint8_t reg) {
+    if (reg < R_COUNT) {
+        return ref->registers[reg];
+    }
+
+    switch (reg) {
+        case R_ST: return ref->status;
+        case R_AS: return ref->as;
+        case R_DS: return ref->ds;
+        case R_XL: return LO_BYTE(ref->x);
+        case R_XH: return HI_BYTE(ref->x);
+        case R_YL: return LO_BYTE(ref->y);
+        case R_YH: return HI_BYTE(ref->y);
+        case R_X: return read_mem(ref, ref->x);
+        case R_Y: return read_mem(ref, ref->y);
+        default: return 0x00;
+    }
+}
+
+static void set_reg(ref_vm_t* ref, uint8_t reg, uint8_t value) {
+    if (reg < R_COUNT) {
+        ref->registers[reg] = value;
+        return;
+    }
+
+    switch (reg) {
+        case R_ST: ref->status = value; break;
+        case R_AS: ref->as = value; break;
+        case R_DS: ref->ds = value; break;
+        case R_XL: ref->x = (ref->x & 0xFF00) + value; break;
+        case R_XH: ref->x = (ref->x & 0x00FF) + (value << 8); break;
+        case R_YL: ref->y = (ref->y & 0xFF00) + value; break;
+        case R_YH: ref->y = (ref->y & 0x00FF) + (value << 8); break;
+        // writing x or y as a register stores through the pointer for free
+        case R_X: store(ref, ref->x, value); break;
+        case R_Y: store(ref, ref->y, value); break;
+    }
+}
+
+static void add(ref_vm_t* ref, uint8_t reg, uint8_t value, bool with_carry) {
+    if (is_word_reg(reg)) {
+        return;
+    }
+    ref->cycle++;
+    uint16_t result = get_reg(ref, reg) + value;
+    if (with_carry) {
+        result += flag(ref, FLAG_CARRY);
+        ref->status &= ~FLAG_CARRY;
+    }
+    set_reg(ref, reg, (uint8_t)result);
+    set_flags(ref, result);
+}
+
+static void sub(ref_vm_t* ref, uint8_t reg, uint8_t value, bool with_borrow) {
+    if (is_word_reg(reg)) {
+        return;
+    }
+    ref->cycle++;
+    uint16_t result = get_reg(ref, reg) - value;
+    if (with_borrow) {
+        result -= flag(ref, FLAG_CARRY);
+        ref->status &= ~FLAG_CARRY;
+    }
+    set_reg(ref, reg, (uint8_t)result);
+    set_flags(ref, result);
+}
+
+static void cmp(ref_vm_t* ref, uint8_t reg, uint8_t value) {
+    if (is_word_reg(reg)) {
+        return;
+    }
+    ref->cycle++;
+    // the high halves of x and y compare against the value shifted up
+    uint8_t shift = (reg == R_XH || reg == R_YH) ? 8 : 0;
+    set_flags(ref, get_reg(ref, reg) - (value << shift));
+}
+
+static void and_or(ref_vm_t* ref, uint8_t reg, uint8_t value, bool is_or) {
+    if (is_word_reg(reg)) {
+        return;
+    }
+    ref->cycle++;
+    uint16_t result = is_or ? (get_reg(ref, reg) | value) : (get_reg(ref, reg) & value);
+    set_reg(ref, reg, (uint8_t)result);
+    set_flags(ref, result);
+}
+
+static void not(ref_vm_t* ref, uint8_t reg) {
+    if (is_word_reg(reg)) {
+        return;
+    }
+    ref->cycle++;
+    uint8_t result = ~get_reg(ref, reg);
+    set_reg(ref, reg, result);
+    set_flags(ref, result);
+}
+
+static void push(ref_vm_t* ref, uint8_t value) {
+    write_mem(ref, COMBINE_TO_WORD(ref->ds--, 0x01), value);
+}
+
+static uint8_t pop(ref_vm_t* ref) {
+    return read_mem(ref, COMBINE_TO_WORD(++ref->ds, 0x01));
+}
+
+// source operand of mov and the math ops, by mode % 4
+static uint8_t source(ref_vm_t* ref, uint8_t mode) {
+    switch (mode % 4) {
+        case 0: return get_reg(ref, fetch(ref));
+        case 1: return read_mem(ref, fetch_word(ref));
+        case 2: return fetch(ref);
+        default: return read_mem(ref, read_mem_word(ref, fetch_word(ref)));
+    }
+}
+
+static void mov(ref_vm_t* ref, uint8_t instruction) {
+    uint8_t mode = instruction >> 4;
+    if (mode >= 0xC) {
+        return bad_instruction(ref);
+    }
+
+    uint16_t dest = mode < 4 ? fetch(ref) : fetch_word(ref);
+    uint8_t value = source(ref, mode);
+    if (mode < 4) {
+        set_reg(ref, (uint8_t)dest, value);
+    } else {
+        write_mem(ref, dest, value);
+    }
+}
+
+static void math(ref_vm_t* ref, uint8_t instruction) {
+    uint8_t op = instruction & 0x0F;
+    uint8_t mode = instruction >> 4;
+    uint8_t reg = op < 8 ? fetch(ref) : 0;
+    uint8_t value = 0;
+
+    if (op == 8 && mode >= 4 && mode < 8) {
+        if (mode == 4) {
+            uint8_t dest = fetch(ref);
+            set_reg(ref, dest, pop(ref));
+        } else if (mode == 5) {
+            uint16_t dest = fetch_word(ref);
+            write_mem(ref, dest, pop(ref));
+        } else if (mode == 7) {
+            uint16_t dest = read_mem_word(ref, fetch_word(ref));
+            write_mem(ref, dest, pop(ref));
+        } else {
+            bad_instruction(ref);
+        }
+        return;
+    }
+
+    if (mode < 8) {
+        value = source(ref, mode);
+    } else {
+        // stops the machine, but add/sub/cmp still run with a zero operand
+        bad_instruction(ref);
+    }
+
+    if (op == 3) {
+        add(ref, reg, value, mode > 3);
+    } else if (op == 4) {
+        sub(ref, reg, value, mode > 3);
+    } else if (op == 5) {
+        cmp(ref, reg, value);
+    } else if (op == 7 && mode < 8) {
+        and_or(ref, reg, value, mode >= 4);
+    } else if (op == 8 && mode < 4) {
+        push(ref, value);
+    } else {
+        bad_instruction(ref);
+    }
+}
+
+void ref_init(ref_vm_t* ref) {
+    memset(ref, 0, sizeof(*ref));
+    ref->pc = 0x0200;
+    ref->as = 0xFF;
+    ref->ds = 0xFF;
+    ref->running = true;
+}
+
+void ref_step(ref_vm_t* ref) {
+    ref->cycle = 0;
+    uint8_t instruction = fetch(ref);
+    uint8_t op = instruction & 0x0F;
+
+    if (op == 2) {
+        return mov(ref, instruction);
+    }
+    if (op == 3 || op == 4 || op == 5 || op == 7 || op == 8) {
+        return math(ref, instruction);
+    }
+
+    switch (instruction) {
+        case 0x00: // nop
+        case 0xFE: // dbg only prints
+            break;
+        case 0xFF: // end
+            ref->running = false;
+            break;
+        case 0x10: // jmp
+            ref->pc = fetch_word(ref);
+            break;
+        case 0x20: // inc
+            add(ref, fetch(ref), 1, false);
+            break;
+        case 0x30: // dec
+            sub(ref, fetch(ref), 1, false);
+            break;
+        case 0x40: // clc
+            ref->status &= ~FLAG_CARRY;
+            break;
+        case 0x50: // sec
+            ref->status |= FLAG_CARRY;
+            break;
+        case 0x60: // not
+            not(ref, fetch(ref));
+            break;
+        case 0x70: // jsr
+            {
+                uint16_t return_addr = ref->pc + 2;
+                write_mem(ref, COMBINE_TO_WORD(ref->as--, 0x00), LO_BYTE(return_addr));
+                write_mem(ref, COMBINE_TO_WORD(ref->as--, 0x00), HI_BYTE(return_addr));
+                ref->pc = fetch_word(ref);
+            }
+            break;
+        case 0x80: // ret
+            {
+                uint8_t high = read_mem(ref, COMBINE_TO_WORD(++ref->as, 0x00));
+                uint8_t low = read_mem(ref, COMBINE_TO_WORD(++ref->as, 0x00));
+                ref->pc = COMBINE_TO_WORD(low, high);
+            }
+            break;
+        case 0x01: // beq
+        case 0x11: // bne
+        case 0x21: // blt
+        case 0x31: // ble
+        case 0x41: // bgt
+        case 0x51: // bge
+            {
+                uint16_t addr = fetch_word(ref);
+                bool zero = flag(ref, FLAG_ZERO);
+                bool carry = flag(ref, FLAG_CARRY);
+                bool taken[] = { zero, !zero, carry, carry || zero, !carry && !zero, zero || !carry };
+                if (taken[instruction >> 4]) {
+                    ref->pc = addr;
+                }
+            }
+            break;
+        default:
+            // includes $FD, which is only valid where the debugger patched a breakpoint
+            bad_instruction(ref);
+            break;
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../../src/vm_cpu.h"
+
+#define REF_MAX_WRITES 16
+
+// State of the reference interpreter, laid out like vm_t without any of
+// the caches or deferred work an execution engine may keep.
+typedef struct {
+    uint8_t memory[MAX_MEMORY];
+
+    uint8_t registers[R_COUNT];
+    uint8_t status;
+    uint8_t as;
+    uint8_t ds;
+
+    uint16_t pc;
+    uint16_t x;
+    uint16_t y;
+
+    bool running;
+    uint32_t cycle;         // cycles of the last instruction, like vm.cycle
+
+    // memory writes since the runner last cleared write_count
+    uint16_t write_addrs[REF_MAX_WRITES];
+    uint8_t write_values[REF_MAX_WRITES];
+    int write_count;
+} ref_vm_t;
+
+void ref_init(ref_vm_t* ref);
+void ref_step(ref_vm_t* ref);
@@ -0,0 +1,515 @@
+import argparse
+import math
+import sys
+from typing import Callable, Dict, Iterable, List, Optional, Set, Tuple
+
+from assembler import PeepholeOptimizer, assemble, process_line
+from cycle_table import (BRANCH_OPS, OP_BNE, OP_CMP_IMMEDIATE, OP_DEC, OP_END, OP_INC, OP_JMP, OP_JSR,
+                         OP_MOV_IMMEDIATE, OP_RET, R_COUNT, instruction_cycles, instruction_length,
+                         written_register)
+
+RESET_PC = 0x0200           # see init_cpu in vm_cpu.c
+CLOCK_SPEED = 1000000
+FRAME_RATE = 60
+COUNTER_WRAP = 256          # a byte counter stepped by one comes back around after 256 steps
+BYTE_REGISTERS = list(range(R_COUNT)) + [0x0B, 0x0C, 0x0D, 0x0E]   # r0-r7, xl, xh, yl, yh
+INFINITE = math.inf
+
+class Instruction:
+    def __init__(self, address: int, code: bytes):
+        self.address = address
+        self.code = code
+        self.opcode = code[0]
+        self.length = len(code)
+        self.cycles = instruction_cycles(code)
+
+    @property
+    def target(self) -> int:
+        return self.code[1] | self.code[2] << 8
+
+    def successors(self) -> List[int]:
+        """Where execution goes next within the same routine; a jsr carries on after the call."""
+        next_address = (self.address + self.length) & 0xFFFF
+        if self.opcode in [OP_RET, OP_END]:
+            return []
+        if self.opcode == OP_JMP:
+            return [self.target]
+        if self.opcode in BRANCH_OPS:
+            return [self.target, next_address]
+        return [next_address]
+
+class Loop:
+    def __init__(self, header: int, iteration_best: float, iteration_worst: float,
+                 count: Optional[int], exact: bool):
+        self.header = header
+        self.iteration_best = iteration_best
+        self.iteration_worst = iteration_worst
+        self.count = count      # most iterations, None when no bound was found
+        self.exact = exact      # count is exactly how often the loop runs
+
+    def precision(self) -> int:
+        return 0 if self.count is None else 2 if self.exact else 1
+
+class Cost:
+    def __init__(self, best: float, worst: float, loops: List[Loop]):
+        self.best = best        # INFINITE when it never returns
+        self.worst = worst      # INFINITE when it may not return or a loop has no bound
+        self.loops = loops
+
+def topological_order(start: int, successors: Callable[[int], Iterable[int]]) -> Optional[List[int]]:
+    """Nodes reachable from start, each before its successors, or None on a cycle."""
+    order = []
+    state = {start: 1}
+    stack = [(start, iter(successors(start)))]
+    while stack:
+        node, pending = stack[-1]
+        for successor in pending:
+            if state.get(successor) == 1:
+                return None
+            if successor not in state:
+                state[successor] = 1
+                stack.append((successor, iter(successors(successor))))
+                break
+        else:
+            state[node] = 2
+            order.append(node)
+            stack.pop()
+    order.reverse()
+    return order
+
+def back_edges(start: int, successors: Dict[int, List[int]]) -> List[Tuple[int, int]]:
+    edges = []
+    state = {start: 1}
+    stack = [(start, iter(successors[start]))]
+    while stack:
+        node, pending = stack[-1]
+        for successor in pending:
+            if state.get(successor) == 1:
+                edges.append((node, successor))
+            elif successor not in state:
+                state[successor] = 1
+                stack.append((successor, iter(successors[successor])))
+                break
+        else:
+            state[node] = 2
+            stack.pop()
+    return edges
+
+def repeat(count: int, iteration: float, last: float) -> float:
+    # count - 1 full iterations and the one that leaves, without 0 * inf
+    return last if count == 1 else (count - 1) * iteration + last
+
+class Program:
+    def __init__(self, chunks, labels: Dict[str, int]):
+        self.memory = bytearray(0x10000)
+        self.assembled = bytearray(0x10000)
+        for pc, bank, data in chunks:
+            # which bank is mapped is only known at run time
+            if bank is not None:
+                continue
+            self.memory[pc:pc + len(data)] = data
+            self.assembled[pc:pc + len(data)] = b'\x01' * len(data)
+
+        self.names: Dict[int, str] = {}
+        for name, address in labels.items():
+            if address >= 0 and address not in self.names:
+                self.names[address] = name
+
+        self.instructions: Dict[int, Optional[Instruction]] = {}
+        self.costs: Dict[int, Cost] = {}
+        self.in_progress: Set[int] = set()
+        self.writes: Dict[int, Set[int]] = {}
+        self.warnings: Set[str] = set()
+
+    def name(self, address: int) -> str:
+        return self.names.get(address, f'${address:04X}')
+
+    def instruction(self, address: int) -> Optional[Instruction]:
+        if address not in self.instructions:
+            instruction = None
+            length = instruction_length(self.memory[address]) if self.assembled[address] else None
+            if length is not None and address + length <= 0x10000 and all(self.assembled[address:address + length]):
+                instruction = Instruction(address, bytes(self.memory[address:address + length]))
+            self.instructions[address] = instruction
+        return self.instructions[address]
+
+    def discover(self, entry: int) -> Set[int]:
+        """Every instruction that can run from entry, following calls."""
+        seen = set()
+        pending = [entry]
+        while pending:
+            address = pending.pop()
+            if address in seen:
+                continue
+            seen.add(address)
+            instruction = self.instruction(address)
+            if instruction is None:
+                continue
+            pending += instruction.successors()
+            if instruction.opcode == OP_JSR:
+                pending.append(instruction.target)
+        return seen
+
+    def written_registers(self, entry: int) -> Set[int]:
+        if entry not in self.writes:
+            registers = set()
+            for address in self.discover(entry):
+                instruction = self.instruction(address)
+                if instruction is not None:
+                    registers.add(written_register(instruction.code))
+            self.writes[entry] = registers
+        return self.writes[entry]
+
+    def analyze(self, entry: int) -> Cost:
+        """Best and worst case cycles from entry up to and including the ret
+        (or end) that leaves it."""
+        if entry in self.costs:
+            return self.costs[entry]
+        if entry in self.in_progress:
+            self.warnings.add(f'{self.name(entry)} is recursive, its worst case has no bound')
+            return Cost(0, INFINITE, [])
+        self.in_progress.add(entry)
+
+        # instruction graph of the routine, calls count as one node
+        successors: Dict[int, List[int]] = {}
+        best: Dict[int, float] = {}
+        worst: Dict[int, float] = {}
+        exits: Set[int] = set()
+        pending = [entry]
+        while pending:
+            address = pending.pop()
+            if address in successors:
+                continue
+            instruction = self.instruction(address)
+            if instruction is None:
+                self.warnings.add(f'${address:04X}: execution reaches bytes that are not an instruction')
+                successors[address] = []
+                best[address] = worst[address] = 0
+                exits.add(address)
+                continue
+            successors[address] = instruction.successors()
+            best[address] = worst[address] = instruction.cycles
+            if instruction.opcode == OP_JSR:
+                callee = self.analyze(instruction.target)
+                best[address] += callee.best
+                worst[address] += callee.worst
+            if not successors[address]:
+                exits.add(address)
+            pending += successors[address]
+
+        predecessors: Dict[int, List[int]] = {address: [] for address in successors}
+        for address, targets in successors.items():
+            for target in targets:
+                predecessors[target].append(address)
+
+        # natural loops, merged by header
+        latches: Dict[int, List[int]] = {}
+        for latch, header in back_edges(entry, successors):
+            latches.setdefault(header, []).append(latch)
+        bodies = {}
+        for header, header_latches in latches.items():
+            body = {header}
+            pending = list(header_latches)
+            while pending:
+                address = pending.pop()
+                if address not in body:
+                    body.add(address)
+                    pending += predecessors[address]
+            bodies[header] = body
+
+        # collapse loops innermost first, each becomes one node costing all its iterations
+        parent = {address: address for address in successors}
+        members = {address: {address} for address in successors}
+
+        def find(address: int) -> int:
+            while parent[address] != address:
+                address = parent[address]
+            return address
+
+        def node_successors(node: int) -> Set[int]:
+            result = set()
+            for member in members[node]:
+                for target in successors[member]:
+                    target = find(target)
+                    if target != node:
+                        result.add(target)
+            return result
+
+        loops = []
+        for header in sorted(bodies, key=lambda h: len(bodies[h])):
+            body = {find(address) for address in bodies[header]}
+            inside: Dict[int, List[int]] = {node: [] for node in body}
+            latch_nodes = set()
+            exiting = set()
+            for node in body:
+                for target in node_successors(node):
+                    if target == header:
+                        latch_nodes.add(node)
+                    elif target in body:
+                        inside[node].append(target)
+                    else:
+                        exiting.add(node)
+
+            order = topological_order(header, lambda node: inside[node])
+            if order is None:
+                self.warnings.add(f'{self.name(header)}: loop has more than one entry, its worst case has no bound')
+                far = {node: INFINITE for node in body}
+                near = {node: 0 for node in body}
+            else:
+                far = {header: worst[header]}
+                near = {header: best[header]}
+                for node in order:
+                    for target in inside[node]:
+                        far[target] = max(far.get(target, -INFINITE), far[node] + worst[target])
+                        near[target] = min(near.get(target, INFINITE), near[node] + best[target])
+
+            iteration_worst = max(far.get(node, INFINITE) for node in latch_nodes)
+            iteration_best = min(near.get(node, 0) for node in latch_nodes)
+            count, exact = self.loop_bound(header, bodies[header], latches[header], predecessors)
+            loops.append(Loop(header, iteration_best, iteration_worst, count, exact))
+
+            if not exiting:
+                total_best = total_worst = INFINITE
+            else:
+                exit_worst = max(far.get(node, INFINITE) for node in exiting)
+                exit_best = min(near.get(node, 0) for node in exiting)
+                total_worst = INFINITE if count is None else repeat(count, iteration_worst, exit_worst)
+                total_best = exit_best
+                if exact and exiting <= latch_nodes:
+                    total_best = repeat(count, iteration_best, exit_best)
+
+            for node in body:
+                if node != header:
+                    parent[node] = header
+                    members[header] |= members[node]
+            best[header] = total_best
+            worst[header] = total_worst
+            exits.discard(header)
+
+        order = topological_order(find(entry), node_successors)
+        far: Dict[int, float] = {}
+        near: Dict[int, float] = {}
+        for node in reversed(order or []):
+            targets = node_successors(node)
+            if targets:
+                far[node] = worst[node] + max(far[target] for target in targets)
+                near[node] = best[node] + min(near[target] for target in targets)
+            elif node in exits:
+                far[node] = worst[node]
+                near[node] = best[node]
+            else:
+                far[node] = near[node] = INFINITE
+
+        root = find(entry)
+        cost = Cost(near.get(root, 0), far.get(root, INFINITE), loops)
+        self.in_progress.discard(entry)
+        self.costs[entry] = cost
+        return cost
+
+    def loop_bound(self, header: int, body: Set[int], loop_latches: List[int],
+                   predecessors: Dict[int, List[int]]) -> Tuple[Optional[int], bool]:
+        """Iterations of a loop counted in a byte register: it closes with
+        `dec reg ; bne` or `inc reg ; cmp reg, #K ; bne` (or dec with cmp, or inc
+        until it wraps), and nothing else in the loop, calls included, writes reg.
+        Exact when the count starts from a `mov reg, #N` just before the loop."""
+        if len(loop_latches) != 1:
+            return None, False
+
+        def only_predecessor(address: int) -> Optional[Instruction]:
+            found = predecessors.get(address, [])
+            return self.instruction(found[0]) if len(found) == 1 else None
+
+        latch = self.instruction(loop_latches[0])
+        if latch is None or latch.opcode != OP_BNE or latch.target != header:
+            return None, False
+
+        test = only_predecessor(latch.address)
+        if test is None:
+            return None, False
+        limit = 0
+        step = test
+        if test.opcode == OP_CMP_IMMEDIATE:
+            limit = test.code[2]
+            step = only_predecessor(test.address)
+            if step is None or step.code[1:2] != test.code[1:2]:
+                return None, False
+        if step.opcode not in [OP_INC, OP_DEC] or step.code[1] not in BYTE_REGISTERS:
+            return None, False
+        counter = step.code[1]
+
+        for address in body:
+            instruction = self.instruction(address)
+            if instruction is None:
+                return None, False
+            if address != step.address and written_register(instruction.code) == counter:
+                return None, False
+            if instruction.opcode == OP_JSR and counter in self.written_registers(instruction.target):
+                return None, False
+
+        # last write to the counter on the way in
+        start = None
+        outside = [address for address in predecessors[header] if address not in body]
+        instruction = self.instruction(outside[0]) if len(outside) == 1 else None
+        visited = {header}
+        while instruction is not None and instruction.address not in visited:
+            visited.add(instruction.address)
+            if written_register(instruction.code) == counter:
+                if instruction.opcode == OP_MOV_IMMEDIATE:
+                    start = instruction.code[2]
+                break
+            if instruction.opcode == OP_JSR and counter in self.written_registers(instruction.target):
+                break
+            instruction = only_predecessor(instruction.address)
+
+        if start is None:
+            return COUNTER_WRAP, False
+        steps = (start - limit) if step.opcode == OP_DEC else (limit - start)
+        return (steps % COUNTER_WRAP) or COUNTER_WRAP, True
+
+    def verify(self, trace_filename: str) -> bool:
+        """Checks a `tangovm --trace` run: every instruction must cost what the
+        table says and every call must fall between its best and worst case."""
+        mismatches = []
+        checked = fused = skipped = 0
+        total = 0
+        calls: List[Tuple[int, int]] = []
+        measured: Dict[int, List[int]] = {}
+
+        with open(trace_filename, 'r') as trace:
+            for line in trace:
+                words = line.split()
+                if len(words) != 2:
+                    continue
+                address = int(words[0], 16)
+                cycles = int(words[1])
+                total += cycles
+
+                instruction = self.instruction(address)
+                if instruction is None:
+                    skipped += 1
+                    continue
+                checked += 1
+
+                if cycles != instruction.cycles:
+                    # superinstructions report both halves on the first one's line
+                    second_address = instruction.target if instruction.opcode == OP_JSR \
+                        else (address + instruction.length) & 0xFFFF
+                    second = self.instruction(second_address)
+                    if second is None or cycles != instruction.cycles + second.cycles:
+                        mismatches.append(f'${address:04X}: measured {cycles} cycles, table says {instruction.cycles}')
+                        continue
+                    fused += 1
+                    if instruction.opcode == OP_JSR:
+                        measured.setdefault(instruction.target, []).append(second.cycles)
+                        continue
+
+                if instruction.opcode == OP_JSR:
+                    calls.append((instruction.target, total))
+                elif instruction.opcode == OP_RET and calls:
+                    target, start = calls.pop()
+                    measured.setdefault(target, []).append(total - start)
+
+        print(f'Trace: {checked} instructions checked ({fused} fused pairs), {skipped} outside the assembled code')
+        for mismatch in mismatches[:20]:
+            print(f'  {mismatch}')
+        if len(mismatches) > 20:
+            print(f'  ... {len(mismatches) - 20} more')
+
+        outside_bounds = 0
+        print(f'{"routine":24} {"calls":>7} {"measured":>15} {"static":>15}')
+        for target in sorted(measured):
+            cost = self.analyze(target)
+            low, high = min(measured[target]), max(measured[target])
+            ok = cost.best <= low and high <= cost.worst
+            outside_bounds += 0 if ok else 1
+            print(f'{self.name(target):24} {len(measured[target]):7} {f"{low}-{high}":>15} '
+                  f'{f"{format_cycles(cost.best)}-{format_cycles(cost.worst)}":>15}'
+                  f'{"" if ok else "  OUTSIDE STATIC BOUNDS"}')
+
+        return not mismatches and not outside_bounds
+
+def format_cycles(cycles: float) -> str:
+    return 'inf' if cycles == INFINITE else str(int(cycles))
+
+def describe_loop(loop: Loop, name: str) -> str:
+    if loop.iteration_best == loop.iteration_worst:
+        per_iteration = f'{format_cycles(loop.iteration_worst)}'
+    else:
+        per_iteration = f'{format_cycles(loop.iteration_best)}-{format_cycles(loop.iteration_worst)}'
+    if loop.count is None:
+        bound = 'no bound found'
+    elif loop.exact:
+        bound = f'runs {loop.count} times'
+    else:
+        bound = f'at most {loop.count} times'
+    return f'{name}: {per_iteration} cycles per iteration, {bound}'
+
+def main():
+    parser = argparse.ArgumentParser(description='Static cycle costs of an assembly program')
+    parser.add_argument('source_file', metavar='source_file', type=str, help='ASM source file to analyze')
+    parser.add_argument('-O', '--optimize', dest='optimize', action='store_true',
+                        help='Analyze the optimized program, as assembled with -O')
+    parser.add_argument('--clock', dest='clock_speed', type=int, default=CLOCK_SPEED,
+                        help='Cycles per second, for the frame budget')
+    parser.add_argument('--verify', dest='trace_file', metavar='trace_file', default=None,
+                        help='Check the cycle table and routine bounds against `tangovm --trace` output')
+    args = parser.parse_args()
+
+    with open(args.source_file, 'r') as source:
+        lines = [(line_no, process_line(line.strip('\n'))) for line_no, line in enumerate(source)]
+    if args.optimize:
+        PeepholeOptimizer(lines, False).run()
+
+    result = assemble(lines)
+    if result is None:
+        sys.exit(1)
+    program = Program(*result)
+    program.names.setdefault(RESET_PC, 'reset')
+
+    code = program.discover(RESET_PC)
+    routines = {program.instruction(address).target for address in code
+                if program.instruction(address) is not None and program.instruction(address).opcode == OP_JSR}
+    entries = sorted(address for address in code if address in program.names or address == RESET_PC)
+    frame_budget = args.clock_speed // FRAME_RATE
+
+    print(f'Frame budget: {frame_budget} cycles ({args.clock_speed} Hz / {FRAME_RATE})')
+    print(f'{"label":24} {"address":>7} {"best":>9} {"worst":>9}')
+    warnings = []
+    loops: Dict[int, Loop] = {}
+    for address in entries:
+        cost = program.analyze(address)
+        # a label inside a loop sees the same loop again from a different header
+        for loop in cost.loops if address in routines or address == RESET_PC else []:
+            if loop.header not in loops or loop.precision() > loops[loop.header].precision():
+                loops[loop.header] = loop
+
+        notes = []
+        if address in routines:
+            notes.append('routine')
+        if cost.best == INFINITE:
+            notes.append('does not return')
+        elif cost.worst == INFINITE:
+            notes.append('unbounded')
+        elif cost.worst > frame_budget:
+            warnings.append(f'{program.name(address)} can take {int(cost.worst)} cycles, '
+                            f'{cost.worst / frame_budget:.1f} frames')
+        print(f'{program.name(address):24} ${address:04X}   {format_cycles(cost.best):>9} '
+              f'{format_cycles(cost.worst):>9}  {", ".join(notes)}')
+
+    if loops:
+        print('\nLoops')
+        for header in sorted(loops):
+            loop = loops[header]
+            print(f'  {describe_loop(loop, program.name(header))}')
+            if loop.count is None and frame_budget < loop.iteration_worst < INFINITE:
+                warnings.append(f'one iteration of the loop at {program.name(header)} can take '
+                                f'{format_cycles(loop.iteration_worst)} cycles, more than a frame')
+
+    for warning in sorted(program.warnings) + warnings:
+        print(f'warning: {warning}')
+
+    if args.trace_file and not program.verify(args.trace_file):
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
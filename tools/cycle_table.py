@@ -0,0 +1,119 @@
+from typing import Optional
+
+# Cycle costs of every TangoVM instruction, charged the way vm_cpu.c charges
+# vm.cycle: 1 per fetched byte (next_byte), 1 per read_byte/write_byte, 2 per
+# read_word, and 1 for the ALU step of add/sub/cmp/and/or/not/inc/dec on a byte
+# register. Reading x or y as a register reads memory; writing them goes
+# through bus_write and is free. Fused pairs cost the sum of their halves.
+#
+# Keep this in step with vm_cpu.c. `tangovm --trace` prints the cycles of every
+# instruction it runs and `cycle_analyzer.py --verify` compares them with this table.
+
+R_COUNT = 0x08
+R_X = 0xF0
+R_Y = 0xF1
+WORD_REGISTERS = [R_X, R_Y]
+
+OP_NOP = 0x00
+OP_JMP = 0x10
+OP_INC = 0x20
+OP_DEC = 0x30
+OP_NOT = 0x60
+OP_JSR = 0x70
+OP_RET = 0x80
+OP_END = 0xFF
+OP_MOV_IMMEDIATE = 0x22
+OP_CMP_IMMEDIATE = 0x25
+OP_POP_REGISTER = 0x48
+BRANCH_OPS = [0x01, 0x11, 0x21, 0x31, 0x41, 0x51]
+OP_BEQ = 0x01
+OP_BNE = 0x11
+
+# opcode -> length for the instructions that are not mov or math ops
+FIXED_LENGTHS = {
+    0x00: 1, 0x40: 1, 0x50: 1, 0x80: 1, 0xFE: 1, 0xFF: 1,   # nop clc sec ret dbg end
+    0x20: 2, 0x30: 2, 0x60: 2,                              # inc dec not
+    0x10: 3, 0x70: 3,                                       # jmp jsr
+    **{op: 3 for op in BRANCH_OPS},
+}
+
+# bytes and cycles of the source operand by mode % 4: register, mem, immediate, indirect
+SOURCE_LENGTHS = [1, 2, 1, 2]
+SOURCE_ACCESS_CYCLES = [0, 1, 0, 3]   # plus a read for x/y registers
+
+def register_read_cycles(reg: int) -> int:
+    return 1 if reg in WORD_REGISTERS else 0
+
+def alu_cycles(reg: int) -> int:
+    # add_register and friends do nothing at all for x and y
+    return 0 if reg in WORD_REGISTERS else 1
+
+def instruction_length(opcode: int) -> Optional[int]:
+    """Bytes taken by the instruction starting with opcode, None if the VM
+    rejects it."""
+    op = opcode & 0x0F
+    mode = opcode >> 4
+
+    if op == 2:
+        if mode >= 0xC:
+            return None
+        return 1 + (1 if mode < 4 else 2) + SOURCE_LENGTHS[mode % 4]
+    if op in [3, 4, 5, 7]:
+        if mode >= 8:
+            return None
+        return 2 + SOURCE_LENGTHS[mode % 4]
+    if op == 8:
+        if mode < 4:
+            return 1 + SOURCE_LENGTHS[mode]
+        return {4: 2, 5: 3, 7: 3}.get(mode)
+    return FIXED_LENGTHS.get(opcode)
+
+def source_cycles(mode: int, operand: int) -> int:
+    if mode % 4 == 0:
+        return register_read_cycles(operand)
+    return SOURCE_ACCESS_CYCLES[mode % 4]
+
+def instruction_cycles(code: bytes) -> Optional[int]:
+    """Cycles charged for the instruction at the start of code, which must
+    hold all of its bytes. None if the VM rejects it."""
+    opcode = code[0]
+    length = instruction_length(opcode)
+    if length is None:
+        return None
+
+    op = opcode & 0x0F
+    mode = opcode >> 4
+    cycles = length
+
+    if op == 2:
+        # handle_mov_op: a register destination is free, memory takes a write
+        source = code[2] if mode < 4 else code[3]
+        cycles += source_cycles(mode, source)
+        cycles += 0 if mode < 4 else 1
+    elif op in [3, 4, 5, 7]:
+        cycles += source_cycles(mode, code[2]) + alu_cycles(code[1])
+    elif op == 8:
+        if mode < 4:
+            # push_byte writes the data stack
+            cycles += source_cycles(mode, code[1]) + 1
+        else:
+            # pop_byte reads it, then a register, mem or indirect write
+            cycles += {4: 1, 5: 2, 7: 4}[mode]
+    elif opcode in [OP_INC, OP_DEC, OP_NOT]:
+        cycles += alu_cycles(code[1])
+    elif opcode == OP_JSR:
+        cycles += 2   # push_address
+    elif opcode == OP_RET:
+        cycles += 2   # pop_address
+    return cycles
+
+def written_register(code: bytes) -> Optional[int]:
+    """Register the instruction stores a result in, if any."""
+    opcode = code[0]
+    op = opcode & 0x0F
+    mode = opcode >> 4
+    if op == 2 and mode < 4:
+        return code[1]
+    if op in [3, 4, 7] or opcode in [OP_INC, OP_DEC, OP_NOT, OP_POP_REGISTER]:
+        return code[1]
+    return None
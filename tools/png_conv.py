@@ -3,10 +3,22 @@ import sys
 
 from PIL import Image
 
+from rom_format import write_rom
+
+PALETTE_START = 0xFCC0   # palette registers, see vm_system.c
+PALETTE_SIZE = 16
+
+def rgb332(r: int, g: int, b: int) -> int:
+    return round(r * 7 / 255) << 5 | round(g * 7 / 255) << 2 | round(b * 3 / 255)
+
 def main():
     parser = argparse.ArgumentParser(description='Converts images to TangoVM Game Console ROM')
     parser.add_argument('source_filename', metavar='source_filename', type=str, help='image file to convert')
     parser.add_argument('-o', '--out', dest='out_file', metavar='output_file', default='img.rom')
+    parser.add_argument('-c', '--compress', dest='compress', action='store_true',
+                        help='write a packed ROM with compressed sections')
+    parser.add_argument('-p', '--palette', dest='palette', action='store_true',
+                        help='also set the palette registers from the first 16 colors of the image')
     args = parser.parse_args()
 
     with Image.open(args.source_filename) as img:
@@ -18,18 +30,22 @@ def main():
             sys.exit(1)
 
         data = list(img.getdata())
-        rom_output = ''
+        chunks = []
 
         for y in range(64):
             addr = 0xF000 + y * 32
-            rom_output += f'{addr:04X}: '
+            row = bytearray()
             for x in range(0, 64, 2):
                 i = y * 64 + x
                 value = (data[i] << 4) + data[i+1]
-                rom_output += f'{value:02X} '
-            rom_output = rom_output[:-1] + '\n'
+                row.append(value)
+            chunks.append((addr, bytes(row)))
+
+        if args.palette:
+            colors = (img.getpalette() or []) + [0] * PALETTE_SIZE * 3
+            palette = bytes(rgb332(*colors[i * 3:i * 3 + 3]) for i in range(PALETTE_SIZE))
+            chunks.append((PALETTE_START, palette))
 
-        with open(args.out_file, 'w') as outfile:
-            outfile.write(rom_output)
+        write_rom(args.out_file, chunks, args.compress)
 
 if __name__ == '__main__': main()
\ No newline at end of file
@@ -0,0 +1,62 @@
+// Loads each ROM file repeatedly and reports its size, the mean load time and
+// a hash of the memory it produced, so text and packed versions of the same
+// ROM can be compared directly.
+//
+//   rom_bench [-n iterations] rom_file...
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/vm_cpu.h"
+#include "../src/vm_replay.h"
+#include "../src/vm_rom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+static uint8_t memory[MAX_MEMORY];
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+int main(int argc, char** argv) {
+    int iterations = 200;
+    int first_file = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        first_file = 3;
+    }
+    if (first_file >= argc || iterations < 1) {
+        printf("Usage: %s [-n iterations] rom_file...\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-32s %10s %12s  %s\n", "rom", "bytes", "load ms", "memory hash");
+    for (int i = first_file; i < argc; i++) {
+        struct stat st;
+        if (stat(argv[i], &st) < 0) {
+            printf("Could not open %s\n", argv[i]);
+            return 1;
+        }
+
+        double total = 0;
+        for (int n = 0; n < iterations; n++) {
+            memset(memory, 0, sizeof(memory));
+            double start = now_ms();
+            if (!load_rom(argv[i], memory)) {
+                return 1;
+            }
+            total += now_ms() - start;
+        }
+
+        printf("%-32s %10lld %12.4f  %016llx\n", argv[i], (long long)st.st_size, total / iterations,
+            (unsigned long long)hash_bytes(FNV_OFFSET_BASIS, memory, sizeof(memory)));
+    }
+    return 0;
+}
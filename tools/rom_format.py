@@ -0,0 +1,232 @@
+import argparse
+import os
+import re
+import struct
+import sys
+from typing import List, Tuple
+
+"""
+ROM files
+
+Text ROMs hold one chunk per line: a hex load address and the hex bytes to
+put there ("0200: 22 00 00"). Packed ROMs hold the same memory image as a few
+binary sections, each stored raw or LZ compressed. See vm_rom.h for the
+layout; the loader picks the format from the first four bytes.
+"""
+
+ROM_MAGIC = b'TROM'
+ROM_VERSION = 1
+SECTION_RAW = 0
+SECTION_LZ = 1
+
+HEADER_FORMAT = '<4sBBH'        # magic, version, reserved, section count
+SECTION_FORMAT = '<HBBII'       # address, encoding, reserved, size, stored size
+SECTION_HEADER_SIZE = struct.calcsize(SECTION_FORMAT)
+
+MEMORY_SIZE = 0x10000
+MIN_MATCH = 4
+MAX_OFFSET = 0xFFFF
+MATCH_CHAIN = 32                # earlier positions tried per match
+
+Chunk = Tuple[int, bytes]
+
+
+def parse_text_rom(text: str) -> List[Chunk]:
+    chunks = []
+    for line in text.splitlines():
+        values = re.findall(r'[0-9A-Fa-f]+', line)
+        if values:
+            chunks.append((int(values[0], 16) & 0xFFFF, bytes(int(value, 16) & 0xFF for value in values[1:])))
+    return chunks
+
+
+def format_text_rom(chunks: List[Chunk]) -> str:
+    return ''.join(f'{addr:04X}: ' + ' '.join(f'{value:02X}' for value in data) + '\n' for addr, data in chunks)
+
+
+def write_length(out: bytearray, length: int):
+    while length >= 0xFF:
+        out.append(0xFF)
+        length -= 0xFF
+    out.append(length)
+
+
+def lz_compress(data: bytes) -> bytes:
+    out = bytearray()
+    positions = {}
+    anchor = 0
+    i = 0
+
+    def emit(literals: bytes, offset: int = 0, length: int = 0):
+        match_nibble = min(length - MIN_MATCH, 15) if length else 0
+        out.append((min(len(literals), 15) << 4) | match_nibble)
+        if len(literals) >= 15:
+            write_length(out, len(literals) - 15)
+        out.extend(literals)
+        if length:
+            out.extend(struct.pack('<H', offset))
+            if length - MIN_MATCH >= 15:
+                write_length(out, length - MIN_MATCH - 15)
+
+    while i + MIN_MATCH <= len(data):
+        key = data[i:i + MIN_MATCH]
+        candidates = positions.setdefault(key, [])
+
+        best_length = 0
+        best_offset = 0
+        for candidate in reversed(candidates[-MATCH_CHAIN:]):
+            if i - candidate > MAX_OFFSET:
+                break
+            length = MIN_MATCH
+            while i + length < len(data) and data[candidate + length] == data[i + length]:
+                length += 1
+            if length > best_length:
+                best_length = length
+                best_offset = i - candidate
+        candidates.append(i)
+
+        if best_length < MIN_MATCH:
+            i += 1
+            continue
+
+        emit(data[anchor:i], best_offset, best_length)
+        for position in range(i + 1, min(i + best_length, len(data) - MIN_MATCH + 1)):
+            positions.setdefault(data[position:position + MIN_MATCH], []).append(position)
+        i += best_length
+        anchor = i
+
+    emit(data[anchor:])
+    return bytes(out)
+
+
+def lz_decompress(data: bytes, size: int) -> bytes:
+    out = bytearray()
+    i = 0
+
+    def read_length(length: int) -> int:
+        nonlocal i
+        while True:
+            extra = data[i]
+            i += 1
+            length += extra
+            if extra != 0xFF:
+                return length
+
+    while i < len(data):
+        token = data[i]
+        i += 1
+        literals = token >> 4
+        if literals == 15:
+            literals = read_length(literals)
+        out.extend(data[i:i + literals])
+        i += literals
+        if i >= len(data):
+            break
+
+        offset = data[i] | (data[i + 1] << 8)
+        i += 2
+        length = token & 0x0F
+        if length == 15:
+            length = read_length(length)
+        for _ in range(length + MIN_MATCH):
+            out.append(out[-offset])
+
+    if len(out) != size:
+        raise ValueError('corrupt LZ section')
+    return bytes(out)
+
+
+def memory_sections(chunks: List[Chunk]) -> List[Chunk]:
+    """Lays chunks out in memory, later ones winning, and returns the runs of
+    written bytes. Short gaps are folded in as zeros, which is what memory
+    holds before loading, since that's cheaper than another section header."""
+    memory = bytearray(MEMORY_SIZE)
+    written = bytearray(MEMORY_SIZE)
+    for addr, data in chunks:
+        for offset, value in enumerate(data):
+            memory[(addr + offset) % MEMORY_SIZE] = value
+            written[(addr + offset) % MEMORY_SIZE] = 1
+
+    sections = []
+    addr = 0
+    while addr < MEMORY_SIZE:
+        if not written[addr]:
+            addr += 1
+            continue
+        start = addr
+        end = addr
+        while addr < MEMORY_SIZE and (written[addr] or addr - end < SECTION_HEADER_SIZE):
+            if written[addr]:
+                end = addr + 1
+            addr += 1
+        sections.append((start, bytes(memory[start:end])))
+        addr = end
+    return sections
+
+
+def pack_rom(chunks: List[Chunk]) -> bytes:
+    sections = memory_sections(chunks)
+    out = bytearray(struct.pack(HEADER_FORMAT, ROM_MAGIC, ROM_VERSION, 0, len(sections)))
+    for addr, data in sections:
+        compressed = lz_compress(data)
+        if len(compressed) < len(data):
+            out.extend(struct.pack(SECTION_FORMAT, addr, SECTION_LZ, 0, len(data), len(compressed)))
+            out.extend(compressed)
+        else:
+            out.extend(struct.pack(SECTION_FORMAT, addr, SECTION_RAW, 0, len(data), len(data)))
+            out.extend(data)
+    return bytes(out)
+
+
+def unpack_rom(rom: bytes) -> List[Chunk]:
+    magic, version, _, section_count = struct.unpack_from(HEADER_FORMAT, rom)
+    if magic != ROM_MAGIC or version != ROM_VERSION:
+        raise ValueError('not a packed ROM')
+
+    chunks = []
+    i = struct.calcsize(HEADER_FORMAT)
+    for _ in range(section_count):
+        addr, encoding, _, size, stored_size = struct.unpack_from(SECTION_FORMAT, rom, i)
+        i += SECTION_HEADER_SIZE
+        data = rom[i:i + stored_size]
+        i += stored_size
+        chunks.append((addr, data if encoding == SECTION_RAW else lz_decompress(data, size)))
+    return chunks
+
+
+def read_rom(filename: str) -> List[Chunk]:
+    with open(filename, 'rb') as rom_file:
+        rom = rom_file.read()
+    if rom.startswith(ROM_MAGIC):
+        return unpack_rom(rom)
+    return parse_text_rom(rom.decode('ascii'))
+
+
+def write_rom(filename: str, chunks: List[Chunk], compress: bool):
+    if compress:
+        with open(filename, 'wb') as rom_file:
+            rom_file.write(pack_rom(chunks))
+    else:
+        with open(filename, 'w') as rom_file:
+            rom_file.write(format_text_rom(chunks))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Converts TangoVM ROMs between text and packed formats')
+    parser.add_argument('source_filename', metavar='source_filename', type=str, help='ROM file to convert')
+    parser.add_argument('-o', '--out', dest='out_file', metavar='output_file', required=True)
+    parser.add_argument('-t', '--text', dest='text', action='store_true', help='write a text ROM instead of a packed one')
+    args = parser.parse_args()
+
+    try:
+        chunks = read_rom(args.source_filename)
+    except ValueError as error:
+        print(f'{args.source_filename}: {error}')
+        sys.exit(1)
+
+    write_rom(args.out_file, chunks, not args.text)
+    before = os.path.getsize(args.source_filename)
+    after = os.path.getsize(args.out_file)
+    print(f'{args.source_filename}: {before} bytes -> {args.out_file}: {after} bytes')
+
+if __name__ == '__main__': main()